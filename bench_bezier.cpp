@@ -0,0 +1,104 @@
+// bench_bezier.cpp font_to_svg - public domain
+//
+// Microbenchmark of quadratic Bezier flattening over every curve of a font:
+// the fixed-step fullQuadraticBezier, the scalar forward-differencing
+// flattenQuadraticBezier and the vectorized flattenQuadraticBatch kernel.
+
+#include "font_to_svg.hpp"
+#include <chrono>
+
+struct curve_collector {
+  font2svg::quad_batch *q;
+  double tolerance;
+  size_t npoints;
+  double cx, cy;
+  void move(double x, double y) { cx = x; cy = y; }
+  void line(double x, double y) { cx = x; cy = y; }
+  void quad(double x1, double y1, double x2, double y2) {
+    font2svg::Point2D p0(cx, cy), p1(x1, y1), p2(x2, y2);
+    int n = font2svg::quadraticBezierSegments(p0, p1, p2, tolerance);
+    q->add(p0, p1, p2, n, npoints);
+    npoints += n;
+    cx = x2; cy = y2;
+  }
+  void close() {}
+};
+
+struct point_sum {
+  double *sum;
+  point_sum(double &s) : sum(&s) {}
+  void operator()(double x, double y) { *sum += x + y; }
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void report(const char *name, double secs, int rounds, size_t curves, size_t points, double sum) {
+  std::cout << name << ": " << secs / rounds * 1e3 << " ms/round, "
+            << curves * rounds / secs / 1e6 << " Mcurves/s, "
+            << points * rounds / secs / 1e6 << " Mpoints/s"
+            << " (checksum " << sum << ")\n";
+}
+
+int main( int argc, char * argv[] )
+{
+  if (argc < 2 || argc > 4) {
+    std::cerr << "usage: " << argv[0] << " file.ttf [tolerance] [rounds]\n";
+    exit( 1 );
+  }
+  double tolerance = argc > 2 ? atof(argv[2]) : font2svg::defaultTolerance;
+  int rounds = argc > 3 ? atoi(argv[3]) : 20;
+
+  // Collect every quadratic curve of every glyph
+  font2svg::ttf_file font( argv[1] );
+  font2svg::quad_batch q;
+  curve_collector c;
+  c.q = &q; c.tolerance = tolerance; c.npoints = 0; c.cx = c.cy = 0;
+  for (FT_Long g = 0 ; g < font.face->num_glyphs ; g++ ) {
+    if ( FT_Load_Glyph( font.face, g, FT_LOAD_NO_SCALE ) ) continue;
+    FT_Outline &o = font.face->glyph->outline;
+    font2svg::walk_contours( o.points, o.tags, o.contours, o.n_contours, font2svg::affine(), c );
+  }
+  std::cout << font.face->num_glyphs << " glyphs, " << q.size() << " curves, "
+            << c.npoints << " points at tolerance " << tolerance << "\n";
+
+  size_t fixed_points = 0;
+  double sum = 0;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (int r = 0 ; r < rounds ; r++ ) {
+    fixed_points = 0;
+    for (size_t s = 0 ; s < q.size() ; s++ ) {
+      std::vector<font2svg::Point2D> pts = font2svg::fullQuadraticBezier(
+        font2svg::Point2D(q.x0[s], q.y0[s]), font2svg::Point2D(q.x1[s], q.y1[s]), font2svg::Point2D(q.x2[s], q.y2[s]) );
+      for (size_t k = 0 ; k < pts.size() ; k++ ) sum += pts[k].x + pts[k].y;
+      fixed_points += pts.size();
+    }
+  }
+  report("fullQuadraticBezier   ", seconds_since(t0), rounds, q.size(), fixed_points, sum);
+
+  sum = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (int r = 0 ; r < rounds ; r++ ) {
+    for (size_t s = 0 ; s < q.size() ; s++ ) {
+      font2svg::flattenQuadraticBezier(
+        font2svg::Point2D(q.x0[s], q.y0[s]), font2svg::Point2D(q.x1[s], q.y1[s]), font2svg::Point2D(q.x2[s], q.y2[s]),
+        tolerance, point_sum(sum) );
+    }
+  }
+  report("flattenQuadraticBezier", seconds_since(t0), rounds, q.size(), c.npoints, sum);
+
+  std::vector<double> x(c.npoints), y(c.npoints);
+  sum = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (int r = 0 ; r < rounds ; r++ ) {
+    font2svg::flattenQuadraticBatch( q, x.data(), y.data() );
+    if ( !x.empty() ) sum += x[r % x.size()] + y[r % y.size()];
+  }
+  double secs = seconds_since(t0);
+  for (size_t k = 0 ; k < x.size() ; k++ ) sum += x[k] + y[k];
+  report("flattenQuadraticBatch ", secs, rounds, q.size(), c.npoints, sum);
+
+  font.free();
+  return 0;
+}
@@ -7,11 +7,21 @@ else
 fi
 
 WARN="-pedantic -Wall"
-FREETYPE_FLAGS=`freetype-config --cflags --libs`
-SOURCE_FILES="example1 example2 example3 example4 example5"
+if [ "`command -v freetype-config`" ]; then
+  FREETYPE_FLAGS="`freetype-config --cflags --libs` -pthread"
+else
+  FREETYPE_FLAGS="`pkg-config --cflags --libs freetype2` -pthread"
+fi
+if pkg-config --exists zlib 2>/dev/null; then
+  FREETYPE_FLAGS="$FREETYPE_FLAGS -DFONT2SVG_ZLIB `pkg-config --cflags --libs zlib`"
+fi
+SOURCE_FILES="example1 example2 example3 example4 example5 example6"
+
+# the library part, compiled once
+$CC $WARN -c font_to_svg.cpp -o font_to_svg.o $FREETYPE_FLAGS
 
 for sourcefile in $SOURCE_FILES;
-  do $CC $WARN $sourcefile".cpp" -o $sourcefile $FREETYPE_FLAGS
+  do $CC $WARN $sourcefile".cpp" font_to_svg.o -o $sourcefile $FREETYPE_FLAGS
 done
 
 
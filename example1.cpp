@@ -10,16 +10,19 @@ int main( int argc, char * argv[] )
 	}
 
 	font2svg::glyph g( argv[1], argv[2] );
-	std::cout << g.svgheader()
-		<< g.svgborder()
-		<< g.svgtransform()
-		<< g.axes()
-		<< g.typography_box()
-		<< g.points()
-		<< g.pointlines()
-		<< g.outline()
-		<< g.labelpts()
-		<< g.svgfooter();
+	font2svg::file_sink sink( stdout );
+	font2svg::out_buffer svg( sink ); // every piece is written straight into it
+	g.svgheader( svg );
+	g.svgborder( svg );
+	g.svgtransform( svg );
+	g.axes( svg );
+	g.typography_box( svg );
+	g.points( svg );
+	g.pointlines( svg );
+	g.outline( svg );
+	g.labelpts( svg );
+	g.svgfooter( svg );
+	svg.flush();
 
 	g.free();
 
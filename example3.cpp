@@ -1,70 +1,77 @@
 // based on github user ebraminio's code to process Xerxes.ttf into svg
 
-#include <fstream>
 #include "font_to_svg.hpp"
 
-void genSvg(std::string name, std::string charCode) {
+void genSvg(font2svg::bulk_file_writer &out, std::string name, std::string charCode) {
 	font2svg::glyph g("Xerxes.ttf", charCode);
-	std::string fname = std::string("Output/OldPersian-");
+	std::string fname = std::string("OldPersian-");
 	fname += name;
 	fname += ".svg";
-	std::ofstream file( fname.c_str() );
-	file << g.svgheader() << g.outline() << g.svgfooter();
+	font2svg::out_buffer &file = out.begin( fname );
+	g.svgheader( file );
+	g.outline( file );
+	g.svgfooter( file );
 	g.free();
-	file.close();
 }
 
 int main(int argc, char * argv[]) {
-	genSvg("A", "0x103A0");
-	genSvg("I", "0x103A1");
-	genSvg("U", "0x103A2");
-	genSvg("KA", "0x103A3");
-	genSvg("KU", "0x103A4");
-	genSvg("GA", "0x103A5");
-	genSvg("GU", "0x103A6");
-	genSvg("XA", "0x103A7");
-	genSvg("CA", "0x103A8");
-	genSvg("JA", "0x103A9");
-	genSvg("JI", "0x103AA");
-	genSvg("TA", "0x103AB");
-	genSvg("TU", "0x103AC");
-	genSvg("DA", "0x103AD");
-	genSvg("DI", "0x103AE");
-	genSvg("DU", "0x103AF");
-	genSvg("THA", "0x103B0");
-	genSvg("PA", "0x103B1");
-	genSvg("BA", "0x103B2");
-	genSvg("FA", "0x103B3");
-	genSvg("NA", "0x103B4");
-	genSvg("NU", "0x103B5");
-	genSvg("MA", "0x103B6");
-	genSvg("MI", "0x103B7");
-	genSvg("MU", "0x103B8");
-	genSvg("YA", "0x103B9");
-	genSvg("VA", "0x103BA");
-	genSvg("VI", "0x103BB");
-	genSvg("RA", "0x103BC");
-	genSvg("RU", "0x103BD");
-	genSvg("LA", "0x103BE");
-	genSvg("SA", "0x103BF");
-	genSvg("ZA", "0x103C0");
-	genSvg("SHA", "0x103C1");
-	genSvg("SSA", "0x103C2");
-	genSvg("HA", "0x103C3");
-	genSvg("AURAMAZDAA", "0x103C8");
-	genSvg("AURAMAZDAA-2", "0x103C9");
-	genSvg("AURAMAZDAAHA", "0x103CA");
-	genSvg("XSHAAYATHIYA", "0x103CB");
-	genSvg("DAHYAAUSH", "0x103CC");
-	genSvg("DAHYAAUSH-2", "0x103CD");
-	genSvg("BAGA", "0x103CE");
-	genSvg("BUUMISH", "0x103CF");
-	genSvg("WORD DIVIDER", "0x103D0");
-	genSvg("ONE", "0x103D1");
-	genSvg("TWO", "0x103D2");
-	genSvg("TEN", "0x103D3");
-	genSvg("TWENTY", "0x103D4");
-	genSvg("HUNDRED", "0x103D5");
+	// keep the face open so every genSvg() shares it through the registry
+	font2svg::ttf_file font("Xerxes.ttf");
+	// the files are staged in memory and written together
+	font2svg::bulk_file_writer out("Output");
+	genSvg(out, "A", "0x103A0");
+	genSvg(out, "I", "0x103A1");
+	genSvg(out, "U", "0x103A2");
+	genSvg(out, "KA", "0x103A3");
+	genSvg(out, "KU", "0x103A4");
+	genSvg(out, "GA", "0x103A5");
+	genSvg(out, "GU", "0x103A6");
+	genSvg(out, "XA", "0x103A7");
+	genSvg(out, "CA", "0x103A8");
+	genSvg(out, "JA", "0x103A9");
+	genSvg(out, "JI", "0x103AA");
+	genSvg(out, "TA", "0x103AB");
+	genSvg(out, "TU", "0x103AC");
+	genSvg(out, "DA", "0x103AD");
+	genSvg(out, "DI", "0x103AE");
+	genSvg(out, "DU", "0x103AF");
+	genSvg(out, "THA", "0x103B0");
+	genSvg(out, "PA", "0x103B1");
+	genSvg(out, "BA", "0x103B2");
+	genSvg(out, "FA", "0x103B3");
+	genSvg(out, "NA", "0x103B4");
+	genSvg(out, "NU", "0x103B5");
+	genSvg(out, "MA", "0x103B6");
+	genSvg(out, "MI", "0x103B7");
+	genSvg(out, "MU", "0x103B8");
+	genSvg(out, "YA", "0x103B9");
+	genSvg(out, "VA", "0x103BA");
+	genSvg(out, "VI", "0x103BB");
+	genSvg(out, "RA", "0x103BC");
+	genSvg(out, "RU", "0x103BD");
+	genSvg(out, "LA", "0x103BE");
+	genSvg(out, "SA", "0x103BF");
+	genSvg(out, "ZA", "0x103C0");
+	genSvg(out, "SHA", "0x103C1");
+	genSvg(out, "SSA", "0x103C2");
+	genSvg(out, "HA", "0x103C3");
+	genSvg(out, "AURAMAZDAA", "0x103C8");
+	genSvg(out, "AURAMAZDAA-2", "0x103C9");
+	genSvg(out, "AURAMAZDAAHA", "0x103CA");
+	genSvg(out, "XSHAAYATHIYA", "0x103CB");
+	genSvg(out, "DAHYAAUSH", "0x103CC");
+	genSvg(out, "DAHYAAUSH-2", "0x103CD");
+	genSvg(out, "BAGA", "0x103CE");
+	genSvg(out, "BUUMISH", "0x103CF");
+	genSvg(out, "WORD DIVIDER", "0x103D0");
+	genSvg(out, "ONE", "0x103D1");
+	genSvg(out, "TWO", "0x103D2");
+	genSvg(out, "TEN", "0x103D3");
+	genSvg(out, "TWENTY", "0x103D4");
+	genSvg(out, "HUNDRED", "0x103D5");
+	out.close();
+	if (!out.ok()) std::cerr << "writing Output/: " << strerror(out.error) << "\n";
+	font.free();
 	return 0;
 }
 
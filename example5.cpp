@@ -9,43 +9,16 @@ int main( int argc, char * argv[] )
     exit( 1 );
   }
 
+  font2svg::ttf_file font( argv[1] ); // opened once, shared by every glyph
   std::string myMessage = argv[2];
-  double offsetX = 0.0, offsetY = 0.0;
-  for(unsigned int i = 0 ; i < myMessage.size() ; i++ ) {
-    char utf8 = myMessage.at(i);
-    std::stringstream s;
-    s << (int)utf8;    //Not really UTF-8 just a hack
-    std::string unicodeChar = s.str();
-    // std::cout << " unicodeChar = " << unicodeChar << std::endl;
-    font2svg::glyph g( argv[1], unicodeChar.c_str(), offsetX, offsetY, false); //Only line segments no quadratic bezier
-    if ( i == 0 ) {
-      std::cout << g.svgheader();
-    }
-    /*	    << g.svgborder()
-	    << g.svgtransform()
-	    << g.axes()
-	    << g.typography_box()
-	    << g.points()
-	    << g.pointlines() */
-    /* std::cout << g.svgtransform(); */
-    std::cout << g.outline();
-      /* 
-	 << g.labelpts() */
+  font2svg::outline_options options;
+  options.generateBezierStatements = false; //Only line segments no quadratic bezier
+  font2svg::text_run run( font, options ); // every distinct glyph is drawn once, in <defs>
+  run.add_utf8( myMessage );
+  std::cout << run.svg();
 
-    //offsetX += g.bbwidth;
-    if ( g.gWidth <= 0 ) {
-      offsetX += 200; //Static shift
-    }
-    else {
-      offsetX += g.gWidth * 1.1;
-    }
-
-      if ( i == myMessage.size() - 1 ) { 
-	std::cout << g.svgfooter();
-      }
-	  
-    g.free();
-  }
+  run.free();
+  font.free();
 	
   return 0;
 }
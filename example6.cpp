@@ -0,0 +1,23 @@
+// example6.cpp font_to_svg - public domain
+
+#include "font_to_svg.hpp"
+
+int main( int argc, char * argv[] )
+{
+  if (argc<2 || argc>3 || (argc==3 && std::string(argv[2])!="font")) {
+    std::cerr << "usage: " << argv[0] << " file.ttf [font]\n";
+    std::cerr << "writes every glyph as a <symbol>, or as an SVG font with 'font'\n";
+    exit( 1 );
+  }
+
+  font2svg::ttf_file font( argv[1] );
+  font2svg::outline_options options;
+  options.compact = true;
+  font2svg::sprite_writer sprite( font, std::cout,
+    argc==3 ? font2svg::sprite_svg_font : font2svg::sprite_symbols, options );
+  sprite.run( true ); // unmapped glyphs too, by index
+  std::cerr << sprite.written << " glyphs\n";
+
+  font.free();
+  return 0;
+}
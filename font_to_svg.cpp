@@ -0,0 +1,161 @@
+// font_to_svg.cpp - Read Font in TrueType (R) format, write SVG
+// Copyright Don Bright 2013 <hugh.m.bright@gmail.com>
+/*
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+
+  License based on zlib license, by Jean-loup Gailly and Mark Adler
+*/
+
+/* The out of line part of font_to_svg.hpp: the global debug state and
+the functions that write whole outlines. Everything else is inline or a
+template and stays in the header. Build it once, as the font_to_svg
+library, and link it with FreeType. */
+
+#include "font_to_svg.hpp"
+
+namespace font2svg {
+
+std::stringstream debug;
+bool hasDebug = false;
+
+  std::vector<Point2D> fullQuadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+					   double increment) {
+    std::vector<Point2D> res;
+    for(double i = 0 ; i < 1.0 ;  i += increment ) {
+      res.push_back( quadraticBezier(p0, p1, p2, i) );
+    }
+    return res;
+  }
+
+  std::vector<Point2D> flattenQuadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+					      double tolerance) {
+    std::vector<Point2D> res;
+    flattenQuadraticBezier(p0, p1, p2, tolerance, appendPoint2D(res));
+    return res;
+  }
+
+  std::string debugQuadraticBezier(const std::vector<Point2D> &quadBezier)  {
+    std::stringstream res;
+    if ( hasDebug ) {
+      for(unsigned int i = 0 ; i < quadBezier.size() ; i++ ) {
+	res << " Index = " << i << " Point(X,Y) = " << quadBezier[i].x << "," << quadBezier[i].y << "\n";
+      }
+    }
+    return res.str();
+  }
+
+  void svgQuadraticBezier(const std::vector<Point2D> &quadBezier, out_buffer &out)  {
+    for(unsigned int i = 0 ; i < quadBezier.size() ; i++ ) {
+      out.put(" L ");
+      out.put_double(quadBezier[i].x);
+      out.put(' ');
+      out.put_double(quadBezier[i].y);
+      out.put('\n');
+    }
+  }
+
+  std::string svgQuadraticBezier(const std::vector<Point2D> &quadBezier)  {
+    out_buffer res;
+    svgQuadraticBezier(quadBezier, res);
+    return res.str();
+  }
+
+  void svgPathHeader(out_buffer &svg) {
+	svg.put("\n\n  <!-- draw actual outline using lines and Bezier curves-->");
+	svg.put("\n  <path fill='black' stroke='black'"
+		" fill-opacity='0.45' "
+		" stroke-width='2' "
+		" d='");
+  }
+
+  void svgPathFooter(out_buffer &svg) {
+	svg.put("\n  '/>");
+	if ( hasDebug ) {
+		std::cout << "\n<!--\n" << debug.str() << " \n-->\n";
+		debug.str("");
+	}
+  }
+
+  void do_outline(const FT_Vector *points, const char *tags, int n_points, const short *contours, int n_contours, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance)
+{
+	if (n_points==0) { svg.put("<!-- font had 0 points -->"); return; }
+	if (n_contours==0) { svg.put("<!-- font had 0 contours -->"); return; }
+	svgPathHeader(svg);
+	svg_path_emitter emitter(svg, generateBezierStatements, tolerance);
+	walk_contours(points, tags, contours, n_contours, affine(1.0, 1.0, offsetX, offsetY), emitter);
+	svgPathFooter(svg);
+}
+
+  void do_path_data(const outline_ir &ir, const outline_options &options, const affine &t, out_buffer &svg)
+{
+	double scale = options.scale(ir.units_per_em);
+	if (options.compact) {
+		svg_compact_path_emitter emitter(svg, options, scale);
+		ir.replay(emitter, t);
+		return;
+	}
+	// font units keep the historical format unless decimals are asked for
+	int precision = scale != 1.0 || options.decimals() > 0 ? options.decimals() : -1;
+	svg_path_emitter emitter(svg, options.generateBezierStatements, options.tolerance * scale, precision);
+	ir.replay(emitter, t);
+}
+
+  void do_path_data(const outline_ir &ir, const outline_options &options, out_buffer &svg)
+{
+	affine t = affine::svg(options.offsetX, options.offsetY, options.scale(ir.units_per_em));
+	do_path_data(ir, options, t, svg);
+}
+
+  void do_outline(const outline_ir &ir, const outline_options &options, out_buffer &svg)
+{
+	if (ir.px.empty()) { svg.put("<!-- font had 0 points -->"); return; }
+	if (ir.contour_ends.empty()) { svg.put("<!-- font had 0 contours -->"); return; }
+	if (options.compact) {
+		svg.put("<path fill='black' stroke='black' fill-opacity='0.45' stroke-width='2' d='");
+		do_path_data(ir, options, svg);
+		svg.put("'/>");
+		return;
+	}
+	svgPathHeader(svg);
+	do_path_data(ir, options, svg);
+	svgPathFooter(svg);
+}
+
+  void do_outline(const outline_ir &ir, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance)
+{
+	outline_options options;
+	options.offsetX = offsetX;
+	options.offsetY = offsetY;
+	options.generateBezierStatements = generateBezierStatements;
+	options.tolerance = tolerance;
+	do_outline(ir, options, svg);
+}
+
+  void do_outline(const std::vector<FT_Vector> &points, const std::vector<char> &tags, const std::vector<short> &contours, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance)
+{
+	do_outline(points.data(), tags.data(), points.size(), contours.data(), contours.size(), offsetX, offsetY, generateBezierStatements, svg, tolerance);
+}
+
+  std::string do_outline(const std::vector<FT_Vector> &points, const std::vector<char> &tags, const std::vector<short> &contours, double offsetX, double offsetY, bool generateBezierStatements, double tolerance)
+{
+	out_buffer svg;
+	do_outline(points, tags, contours, offsetX, offsetY, generateBezierStatements, svg, tolerance);
+	return svg.str();
+}
+
+} // namespace
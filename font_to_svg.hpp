@@ -38,6 +38,10 @@ SVG paths + nonzero: http://www.w3.org/TR/SVG/paintinhtml#FillProperties
 TrueType is a trademark of Apple Inc. Use of this mark does not imply
 endorsement.
 
+The functions declared here without a body, and the debug globals, are
+defined in font_to_svg.cpp: build it as the font_to_svg library (see
+CMakeLists.txt) or compile it with your own sources.
+
 */
 
 #ifndef __font_to_svg_h__
@@ -50,15 +54,44 @@ endorsement.
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#endif
+#include <ctime>
+#ifdef FONT2SVG_ZLIB
+#include <zlib.h>
+#endif
 
 namespace font2svg {
 
   /** Debug stream */
-std::stringstream debug;
+extern std::stringstream debug;
   /** Enable of disable the debug stream */
-bool hasDebug = false; 
+extern bool hasDebug;
 
-FT_Vector halfway_between( FT_Vector p1, FT_Vector p2 )
+inline FT_Vector halfway_between( FT_Vector p1, FT_Vector p2 )
 {
 	FT_Vector newv;
 	newv.x = p1.x + (p2.x-p1.x)/2.0;
@@ -66,51 +99,635 @@ FT_Vector halfway_between( FT_Vector p1, FT_Vector p2 )
 	return newv;
 }
 
+/* 64-bit FNV-1a; pass the previous result as 'h' to hash several pieces */
+inline uint64_t fnv1a( const void * p, size_t n, uint64_t h = 14695981039346656037ULL )
+{
+	const unsigned char * b = static_cast<const unsigned char *>( p );
+	for ( size_t i = 0 ; i < n ; i++ ) {
+		h ^= b[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* A whole font file in memory, mapped read-only or read into a buffer.
+Faces opened over a mapping with FT_New_Memory_Face read straight from the
+page cache, and every face and thread using the same file shares the same
+pages, but a file truncated or rewritten in place while it is mapped makes
+the next read of a lost page kill the process with SIGBUS. A buffer costs
+the file's size in memory and is a private copy. With map false, or where
+mmap is not available, the file is read into a buffer. */
+class mapped_file
+{
+public:
+	static std::shared_ptr<mapped_file> open( const std::string & fname, bool map = true )
+	{
+		std::shared_ptr<mapped_file> m( new mapped_file );
+		static std::atomic<uint64_t> serial( 0 );
+		m->serial = ++serial;
+#if defined(__unix__) || defined(__APPLE__)
+		if ( !map ) return m->read( fname ) ? m : std::shared_ptr<mapped_file>();
+		int fd = ::open( fname.c_str(), O_RDONLY );
+		if ( fd < 0 ) return std::shared_ptr<mapped_file>();
+		struct stat st;
+		if ( fstat( fd, &st ) != 0 || st.st_size == 0 ) {
+			::close( fd );
+			return std::shared_ptr<mapped_file>();
+		}
+		void * addr = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		::close( fd );
+		if ( addr == MAP_FAILED ) return std::shared_ptr<mapped_file>();
+		m->bytes = static_cast<const FT_Byte *>( addr );
+		m->length = st.st_size;
+		m->mapped = true;
+		return m;
+#else
+		(void)map;
+		return m->read( fname ) ? m : std::shared_ptr<mapped_file>();
+#endif
+	}
+
+	~mapped_file()
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		if ( mapped ) munmap( const_cast<FT_Byte *>( bytes ), length );
+#endif
+	}
+
+	/* True for a mapping, false for a buffer */
+	bool is_mapped() const { return mapped; }
+
+	const FT_Byte * data() const { return bytes; }
+	size_t size() const { return length; }
+
+	/* Unique per mapping for the life of the process, never 0. Identifies
+	these bytes in in-process caches without hashing them. */
+	uint64_t id() const { return serial; }
+
+private:
+	mapped_file() : bytes( NULL ), length( 0 ), serial( 0 ), mapped( false ) {}
+	mapped_file( const mapped_file & );
+	mapped_file & operator=( const mapped_file & );
+
+	bool read( const std::string & fname )
+	{
+		std::ifstream in( fname.c_str(), std::ios::binary );
+		buffer.assign( std::istreambuf_iterator<char>( in ), std::istreambuf_iterator<char>() );
+		if ( buffer.empty() ) return false;
+		bytes = &buffer[0];
+		length = buffer.size();
+		return true;
+	}
+
+	const FT_Byte * bytes;
+	size_t length;
+	uint64_t serial;
+	bool mapped;
+	std::vector<FT_Byte> buffer;
+};
+
+/* Process-wide registry of open faces.
+
+Opening a face makes FreeType parse the whole font file, so every face is
+opened once per (filename, face index) and shared by all ttf_file objects
+that name it. Entries are reference counted and the face is closed when the
+last ttf_file holding it is freed. All faces share a single FT_Library.
+Faces are opened over a mapped_file, so the bytes FreeType reads are the
+bytes font_hash() hashes even if the file is replaced later. It is read
+into memory unless the face is opened memory_mapped (and parallel_export
+always maps): a mapped font that is truncated or rewritten in place, rather
+than replaced, while open can kill the process with SIGBUS. mapped_files
+are shared per filename for as long as any face or caller holds them, so
+the first open of a file decides which kind it gets.
+
+The registry itself is safe to use from several threads, but FreeType
+faces are not, so every entry has a lock: whatever loads a glyph or calls
+FreeType on a shared face holds it (ttf_file::lock_face()), and so do the
+lookup tables shared along with the face. Separate ttf_file objects can
+then be used from separate threads as before, even when they name the
+same file; one ttf_file object is still for one thread at a time.
+*/
+class char_map;
+class kerning_table;
+
+typedef std::unique_lock<std::recursive_mutex> face_lock;
+
+struct face_entry
+{
+	std::string filename;
+	long face_index;
+	FT_Face face;
+	int refcount;
+	std::shared_ptr<mapped_file> mapping;
+	uint64_t hash; // fnv1a of 'mapping', 0 until font_hash() asks for it
+	std::shared_ptr<char_map> cmap; // made by the first char_map::shared()
+	std::shared_ptr<kerning_table> kern; // likewise kerning_table::shared()
+	std::recursive_mutex use; // held while 'face' or its glyph slot is used
+};
+
+class face_registry
+{
+public:
+	static face_registry & instance()
+	{
+		static face_registry registry;
+		return registry;
+	}
+
+	face_entry * acquire( const std::string & fname, long face_index, FT_Error & error,
+		bool memory_mapped = false )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		error = 0;
+		key_type key( fname, face_index );
+		std::map<key_type, face_entry *>::iterator it = faces.find( key );
+		if ( it != faces.end() ) {
+			it->second->refcount++;
+			return it->second;
+		}
+		if ( faces.empty() ) {
+			error = FT_Init_FreeType( &library );
+			if ( hasDebug ) debug << "Init error code: " << error;
+			if ( error ) return NULL;
+		}
+		// over bytes in memory either way, so the face and its content
+		// hash come from the same bytes
+		FT_Face face;
+		std::shared_ptr<mapped_file> m = mapping_locked( fname, memory_mapped );
+		if ( m )
+			error = FT_New_Memory_Face( library, m->data(), m->size(), face_index, &face );
+		else
+			error = FT_Err_Cannot_Open_Resource;
+		if ( error ) {
+			if ( faces.empty() ) FT_Done_FreeType( library );
+			return NULL;
+		}
+		face_entry * e = new face_entry;
+		e->filename = fname;
+		e->face_index = face_index;
+		e->face = face;
+		e->refcount = 1;
+		e->mapping = m;
+		e->hash = 0;
+		faces[key] = e;
+		return e;
+	}
+
+	void retain( face_entry * e )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		e->refcount++;
+	}
+
+	void release( face_entry * e )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if ( --e->refcount > 0 ) return;
+		FT_Error error = FT_Done_Face( e->face );
+		if ( hasDebug ) debug << "\nFree face. error code: " << error;
+		faces.erase( key_type( e->filename, e->face_index ) );
+		delete e;
+		if ( faces.empty() ) {
+			error = FT_Done_FreeType( library );
+			if ( hasDebug ) debug << "\nFree library. error code: " << error;
+		}
+	}
+
+	/* The shared mapping of a font file (or its buffer, if a face read
+	it first), or an empty pointer if it can not be read. */
+	std::shared_ptr<mapped_file> mapping( const std::string & fname )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		return mapping_locked( fname, true );
+	}
+
+	/* fnv1a of the bytes the face was opened from, computed on first
+	use. Never 0. */
+	uint64_t font_hash( face_entry * e )
+	{
+		std::shared_ptr<mapped_file> m;
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			if ( e->hash ) return e->hash;
+			m = e->mapping;
+		}
+		uint64_t h = fnv1a( m->data(), m->size() );
+		if ( !h ) h = 1;
+		std::lock_guard<std::mutex> guard( lock );
+		e->hash = h;
+		return h;
+	}
+
+	/* The table in e's 'slot', made from the face the first time */
+	template <class T>
+	std::shared_ptr<T> attach( face_entry * e, std::shared_ptr<T> face_entry::*slot )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if ( !( e->*slot ) ) e->*slot = std::make_shared<T>( e->face, &e->use );
+		return e->*slot;
+	}
+
+	FT_Library shared_library()
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		return library;
+	}
+
+private:
+	typedef std::pair<std::string, long> key_type;
+
+	face_registry() : library( NULL ) {}
+	face_registry( const face_registry & );
+	face_registry & operator=( const face_registry & );
+
+	std::shared_ptr<mapped_file> mapping_locked( const std::string & fname, bool map )
+	{
+		std::shared_ptr<mapped_file> m = mappings[fname].lock();
+		if ( !m ) {
+			m = mapped_file::open( fname, map );
+			mappings[fname] = m;
+		}
+		return m;
+	}
+
+	std::mutex lock;
+	FT_Library library;
+	std::map<key_type, face_entry *> faces;
+	std::map<std::string, std::weak_ptr<mapped_file> > mappings;
+};
+
+/* A handle on a shared face from the face_registry. Copies share the same
+face; free() (or destruction) drops this handle's reference. */
 class ttf_file
 {
 public:
 	std::string filename;
+	long face_index;
 	FT_Library library;
 	FT_Face face;
 	FT_Error error;
+	face_entry * entry;
 
-	ttf_file()
+	ttf_file() : face_index( 0 ), library( NULL ), face( NULL ), error( 0 ), entry( NULL )
 	{
 		filename = std::string("");
 	}
 
-	ttf_file( std::string fname )
+	/* memory_mapped: if the face is not open yet, map the file instead of
+	reading it into memory. Threads and faces then share the page cache,
+	but the file must not be truncated or rewritten in place while open
+	(see mapped_file). */
+	ttf_file( std::string fname, long face_index = 0, bool memory_mapped = false )
+		: face_index( face_index ), library( NULL ), face( NULL ), error( 0 ), entry( NULL )
 	{
 		filename = fname;
-		error = FT_Init_FreeType( &library );
-		if ( hasDebug ) debug << "Init error code: " << error;
 
-		// Load a typeface
-		error = FT_New_Face( library, filename.c_str(), 0, &face );
+		// Load a typeface, or share it if it is already open
+		entry = face_registry::instance().acquire( filename, face_index, error, memory_mapped );
 		if ( hasDebug ) debug << "\nFace load error code: " << error;
 		if ( hasDebug ) debug << "\nfont filename: " << filename;
-		if (error) {
+		if (error || !entry) {
 			std::cerr << "problem loading file " << filename << "\n";
 			exit(1);
 		}
+		face = entry->face;
+		library = face_registry::instance().shared_library();
 		if ( hasDebug ) debug << "\nFamily Name: " << face->family_name;
 		if ( hasDebug ) debug << "\nStyle Name: " << face->style_name;
 		if ( hasDebug ) debug << "\nNumber of faces: " << face->num_faces;
 		if ( hasDebug ) debug << "\nNumber of glyphs: " << face->num_glyphs;
 	}
 
+	ttf_file( const ttf_file & other )
+		: filename( other.filename ), face_index( other.face_index ),
+		  library( other.library ), face( other.face ), error( other.error ),
+		  entry( other.entry )
+	{
+		if ( entry ) face_registry::instance().retain( entry );
+	}
+
+	ttf_file & operator=( const ttf_file & other )
+	{
+		if ( other.entry ) face_registry::instance().retain( other.entry );
+		free();
+		filename = other.filename;
+		face_index = other.face_index;
+		library = other.library;
+		face = other.face;
+		error = other.error;
+		entry = other.entry;
+		return *this;
+	}
+
+	~ttf_file()
+	{
+		free();
+	}
+
+	/* Hash of the font's bytes, see face_registry::font_hash(). 0 when no
+	face is open, which disables disk caching. */
+	uint64_t hash()
+	{
+		return entry ? face_registry::instance().font_hash( entry ) : 0;
+	}
+
+	/* Hold the face for this thread while loading glyphs or calling
+	FreeType on it: faces are shared by every ttf_file naming the file */
+	face_lock lock_face()
+	{
+		return entry ? face_lock( entry->use ) : face_lock();
+	}
+
+	/* Identifies the face's bytes for in-process caches (glyph_cache), see
+	mapped_file::id(). Cheap, unlike hash(). 0 when no face is open. */
+	uint64_t face_id() const
+	{
+		return entry ? entry->mapping->id() : 0;
+	}
+
 	void free()
 	{
+		if ( !entry ) return;
 		if ( hasDebug ) debug << "\n<!--";
-		error = FT_Done_Face( face );
-		if ( hasDebug ) debug << "\nFree face. error code: " << error;
-		error = FT_Done_FreeType( library );
-		if ( hasDebug ) debug << "\nFree library. error code: " << error;
+		face_registry::instance().release( entry );
 		if ( hasDebug ) debug << "\n-->\n";
+		entry = NULL;
+		face = NULL;
+		library = NULL;
+	}
+
+};
+
+
+/* Where finished output goes: a file descriptor, a FILE*, an ostream,
+a fixed user buffer or a growable out_buffer. Sinks see large blocks
+only; formatting and small writes are buffered by an out_buffer in front
+of them. */
+class output_sink
+{
+public:
+	virtual ~output_sink() {}
+	virtual void write( const char * s, size_t n ) = 0;
+	virtual void flush() {}
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+/* write(2) to a descriptor the caller opened and closes. 'error' keeps
+the errno of the first failed write; later writes are dropped. */
+class fd_sink : public output_sink
+{
+public:
+	int fd;
+	int error;
+
+	explicit fd_sink( int fd ) : fd( fd ), error( 0 ) {}
+
+	void write( const char * s, size_t n )
+	{
+		while ( n > 0 && !error ) {
+			ssize_t w = ::write( fd, s, n );
+			if ( w < 0 ) {
+				if ( errno != EINTR ) error = errno;
+				continue;
+			}
+			s += w;
+			n -= w;
+		}
+	}
+};
+#endif
+
+/* fwrite() to a stdio stream; fflush() on flush() */
+class file_sink : public output_sink
+{
+public:
+	FILE * file;
+
+	explicit file_sink( FILE * f ) : file( f ) {}
+
+	void write( const char * s, size_t n ) { fwrite( s, 1, n, file ); }
+	void flush() { fflush( file ); }
+};
+
+class ostream_sink : public output_sink
+{
+public:
+	std::ostream * os;
+
+	explicit ostream_sink( std::ostream &os ) : os( &os ) {}
+
+	void write( const char * s, size_t n ) { os->write( s, n ); }
+	void flush() { os->flush(); }
+};
+
+/* A caller's buffer of fixed size. What does not fit is dropped and
+'overflow' is set; size() is the number of bytes kept. */
+class fixed_sink : public output_sink
+{
+public:
+	bool overflow;
+
+	fixed_sink( char * buf, size_t capacity ) : overflow( false ), buf( buf ), cap( capacity ), len( 0 ) {}
+
+	void write( const char * s, size_t n )
+	{
+		if ( n > cap - len ) {
+			overflow = true;
+			n = cap - len;
+		}
+		memcpy( buf + len, s, n );
+		len += n;
+	}
+
+	size_t size() const { return len; }
+	void clear() { len = 0; overflow = false; }
+
+private:
+	char * buf;
+	size_t cap, len;
+};
+
+/* Growable byte buffer that the path emitters write into.
+
+Numbers are formatted by hand instead of through iostreams, and clear()
+keeps the allocated storage, so a buffer reused from glyph to glyph stops
+allocating once it has grown to the largest outline. Output is the same
+as an std::ostream with default formatting would produce.
+
+Built over an output_sink the buffer has a fixed capacity instead: when
+it is full its bytes go on to the sink, as they do on flush() and when
+the buffer is destroyed, so data() and size() only cover what is still
+pending and memory stays bounded however much is written. A copy of such
+a buffer is a plain buffer holding the pending bytes.
+*/
+class out_buffer : public output_sink
+{
+public:
+	out_buffer() : len( 0 ), flushed( 0 ), sink( NULL ) {}
+
+	explicit out_buffer( output_sink &sink, size_t capacity = 1 << 16 )
+		: bytes( capacity > 0 ? capacity : 1 ), len( 0 ), flushed( 0 ), sink( &sink ) {}
+
+	out_buffer( const out_buffer &o ) : bytes( o.bytes ), len( o.len ), flushed( 0 ), sink( NULL ) {}
+
+	out_buffer & operator=( const out_buffer &o )
+	{
+		if ( this != &o ) {
+			flush();
+			bytes = o.bytes;
+			len = o.len;
+			flushed = 0;
+			sink = NULL;
+		}
+		return *this;
+	}
+
+	~out_buffer() { if ( sink ) drain(); }
+
+	void clear() { len = 0; }
+	const char * data() const { return bytes.empty() ? "" : &bytes[0]; }
+	size_t size() const { return len; }
+	std::string str() const { return std::string( data(), len ); }
+	bool streaming() const { return sink != NULL; }
+	// bytes already handed to the sink plus the pending ones
+	size_t position() const { return flushed + len; }
+
+	/* Hand the pending bytes to the sink, if there is one */
+	void flush()
+	{
+		if ( !sink ) return;
+		drain();
+		sink->flush();
+	}
+
+	void write( const char * s, size_t n ) { put( s, n ); }
+
+	void put( char c )
+	{
+		reserve( 1 );
+		bytes[len++] = c;
 	}
 
+	void put( const char * s, size_t n )
+	{
+		if ( len + n > bytes.size() && sink ) {
+			drain();
+			if ( n > bytes.size() ) {
+				sink->write( s, n );
+				flushed += n;
+				return;
+			}
+		}
+		reserve( n );
+		memcpy( &bytes[len], s, n );
+		len += n;
+	}
+
+	void put( const char * s ) { put( s, strlen( s ) ); }
+	void put( const std::string & s ) { put( s.data(), s.size() ); }
+
+	void put_int( long v )
+	{
+		char tmp[24];
+		char * end = tmp + sizeof( tmp );
+		char * p = end;
+		unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+		do {
+			*--p = '0' + u % 10;
+			u /= 10;
+		} while ( u );
+		if ( v < 0 ) *--p = '-';
+		put( p, end - p );
+	}
+
+	/* The low 'bytes' bytes of v, little-endian, as zip headers have them */
+	void put_le( uint64_t v, int bytes )
+	{
+		char tmp[8];
+		for ( int i = 0 ; i < bytes ; i++ ) tmp[i] = (char)( v >> ( 8 * i ) );
+		put( tmp, bytes );
+	}
+
+	/* Same text as operator<< with the default precision of 6 */
+	void put_double( double v )
+	{
+		// range first: casting NaN or a huge value to long is undefined
+		if ( v > -1e6 && v < 1e6 && v == (double)(long)v && !( v == 0 && std::signbit( v ) ) ) {
+			put_int( (long)v );
+			return;
+		}
+		char tmp[32];
+		int n = snprintf( tmp, sizeof( tmp ), "%g", v );
+		put( tmp, n );
+	}
+
+	/* v / 10^decimals in as few characters as possible: no trailing
+	zeros after the point and no zero before it ("-.5", "12.25", "3") */
+	void put_fixed( long v, int decimals )
+	{
+		if ( decimals <= 0 ) {
+			put_int( v );
+			return;
+		}
+		unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+		unsigned long unit = 1;
+		for ( int i = 0 ; i < decimals ; i++ ) unit *= 10;
+		unsigned long ip = u / unit, fp = u % unit;
+		while ( fp && fp % 10 == 0 ) { fp /= 10; decimals--; }
+		if ( v < 0 ) put( '-' );
+		if ( ip || !fp ) put_int( (long)ip );
+		if ( !fp ) return;
+		char tmp[24];
+		for ( int i = decimals - 1 ; i >= 0 ; i-- ) {
+			tmp[i] = '0' + fp % 10;
+			fp /= 10;
+		}
+		put( '.' );
+		put( tmp, decimals );
+	}
+
+private:
+	void reserve( size_t n )
+	{
+		if ( len + n <= bytes.size() ) return;
+		if ( sink ) {
+			drain();
+			if ( n <= bytes.size() ) return;
+		}
+		size_t cap = bytes.size() * 2;
+		if ( cap < len + n ) cap = len + n;
+		if ( cap < 256 ) cap = 256;
+		bytes.resize( cap );
+	}
+
+	void drain()
+	{
+		if ( len ) sink->write( &bytes[0], len );
+		flushed += len;
+		len = 0;
+	}
+
+	std::vector<char> bytes;
+	size_t len, flushed;
+	output_sink * sink;
 };
 
+/* Fixed-point numbers for scaled output: a value is stored as the long
+v * 10^decimals, rounded to nearest, so deltas between points are exact
+and out_buffer::put_fixed() prints them without going through printf. */
+const int maxPrecision = 6;
+
+inline long fixedUnit( int decimals )
+{
+	long unit = 1;
+	for ( int i = 0 ; i < decimals ; i++ ) unit *= 10;
+	return unit;
+}
+
+inline long toFixed( double v, long unit )
+{
+	return (long)floor( v * unit + 0.5 );
+}
 
   struct Point2D {
     double x, y;
@@ -119,7 +736,7 @@ public:
   };
 
   /** Return the interpolated Point2D for quadraticBezier */
-  Point2D quadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+  inline Point2D quadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
 			  double t = 0.01) {
     Point2D p;
     p.x = pow(1 - t, 2) * p0.x +
@@ -133,409 +750,3094 @@ public:
   }
   /** Simply iterate on @see quadraticBezier using the provided increment */
   std::vector<Point2D> fullQuadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
-					   double increment = 0.1) {
-    std::vector<Point2D> res;
-    for(double i = 0 ; i < 1.0 ;  i += increment ) {
-      res.push_back( quadraticBezier(p0, p1, p2, i) );
-    }
-    return res;
-  }
+					   double increment = 0.1);
   
-  std::string debugQuadraticBezier(const std::vector<Point2D> &quadBezier)  {
-    std::stringstream res;
-    if ( hasDebug ) {
-      for(unsigned int i = 0 ; i < quadBezier.size() ; i++ ) {
-	res << " Index = " << i << " Point(X,Y) = " << quadBezier[i].x << "," << quadBezier[i].y << "\n";
-      }
+  /** Largest distance (in font units) allowed between a quadratic Bezier
+      and the line segments that replace it when flattening. Scaled outlines
+      use it times outline_options::scale(), so the same curve gets the same
+      number of segments at any emSize. */
+  const double defaultTolerance = 1.0;
+
+  /** Number of line segments needed to keep every point of the curve within
+      'tolerance' of the polyline. Over a parameter step h the chord is at most
+      |p0 - 2 p1 + p2| h^2 / 4 away from the curve. */
+  inline int quadraticBezierSegments(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+			      double tolerance = defaultTolerance) {
+    double ax = p0.x - 2 * p1.x + p2.x;
+    double ay = p0.y - 2 * p1.y + p2.y;
+    double n = ceil(sqrt(sqrt(ax * ax + ay * ay) / (4 * tolerance)));
+    if ( !(n >= 1) ) return 1;  // also catches NaN from a zero tolerance
+    if ( n > 1000 ) return 1000;
+    return (int)n;
+  }
+
+  /** Flatten a quadratic Bezier to within 'tolerance'. Evaluates t = 1/n .. 1
+      by forward differencing and hands each point to emit(x, y); p0 itself is
+      not emitted since it is the current point. */
+  template <typename Emit>
+  void flattenQuadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+			      double tolerance, Emit emit) {
+    int n = quadraticBezierSegments(p0, p1, p2, tolerance);
+    double h = 1.0 / n;
+    // B(t) = p0 + 2t (p1 - p0) + t^2 (p0 - 2 p1 + p2)
+    double ax = p0.x - 2 * p1.x + p2.x, ay = p0.y - 2 * p1.y + p2.y;
+    double dx = 2 * h * (p1.x - p0.x) + h * h * ax;
+    double dy = 2 * h * (p1.y - p0.y) + h * h * ay;
+    double ddx = 2 * h * h * ax, ddy = 2 * h * h * ay;
+    double x = p0.x, y = p0.y;
+    for ( int i = 1 ; i < n ; i++ ) {
+      x += dx; y += dy;
+      dx += ddx; dy += ddy;
+      emit(x, y);
     }
-    return res.str();
+    emit(p2.x, p2.y);
   }
 
-  /** Generate the subpath as line segments */
-  std::string svgQuadraticBezier(const std::vector<Point2D> &quadBezier)  {
-    std::stringstream res;
-    for(unsigned int i = 0 ; i < quadBezier.size() ; i++ ) {
-      res << " L " << quadBezier[i].x << " " << quadBezier[i].y << "\n";
+  /** Collects flattened points into a vector */
+  struct appendPoint2D {
+    std::vector<Point2D> *res;
+    appendPoint2D(std::vector<Point2D> &r) : res(&r) {}
+    void operator()(double x, double y) { res->push_back(Point2D(x, y)); }
+  };
+
+  /** Writes flattened points as " L x y" line segments */
+  struct svgLineTo {
+    out_buffer *out;
+    svgLineTo(out_buffer &o) : out(&o) {}
+    void operator()(double x, double y) {
+      out->put(" L ");
+      out->put_double(x);
+      out->put(' ');
+      out->put_double(y);
+      out->put('\n');
     }
-    return res.str();
+  };
+
+  std::vector<Point2D> flattenQuadraticBezier(const Point2D &p0, const Point2D &p1, const Point2D &p2,
+					      double tolerance = defaultTolerance);
+  
+  std::string debugQuadraticBezier(const std::vector<Point2D> &quadBezier);
+
+  /** Generate the subpath as line segments */
+  void svgQuadraticBezier(const std::vector<Point2D> &quadBezier, out_buffer &out);
+
+  std::string svgQuadraticBezier(const std::vector<Point2D> &quadBezier);
+
+  /** Write " x,y" */
+  inline void svgPoint(out_buffer &out, long x, long y) {
+    out.put(' ');
+    out.put_int(x);
+    out.put(',');
+    out.put_int(y);
   }
 
-/* Draw the outline of the font as svg.
-There are three main components.
-1. the points
-2. the 'tags' for the points
-3. the contour indexes (that define which points belong to which contour)
-4,5. offset on X and Y -> translation
-6. SVG output with Bezier statements (otherwise interpolate and generate only line segments)
-*/
-  std::string do_outline(std::vector<FT_Vector> points, std::vector<char> tags, std::vector<short> contours, double offsetX, double offsetY, bool generateBezierStatements = true)
-{
-	std::stringstream debug, svg;
-	std::cout << "<!-- do outline -->\n";
-	if (points.size()==0) return "<!-- font had 0 points -->";
-	if (contours.size()==0) return "<!-- font had 0 contours -->";
-	svg.str("");
-	svg << "\n\n  <!-- draw actual outline using lines and Bezier curves-->";
-	svg	<< "\n  <path fill='black' stroke='black'"
-		<< " fill-opacity='0.45' "
-		<< " stroke-width='2' "
-		<< " d='";
-
-	/* tag bit 1 indicates whether its a control point on a bez curve
-	or not. two consecutive control points imply another point halfway
-	between them */
-
-	// Step 1. move to starting point (M x-coord y-coord )
-	// Step 2. decide whether to draw a line or a bezier curve or to move
-	// Step 3. for bezier: Q control-point-x control-point-y,
-	//		         destination-x, destination-y
-	//         for line:   L x-coord, y-coord
-	//         for move:   M x-coord, y-coord
-
-	int contour_starti = 0;
-	int contour_endi = 0;
-	for ( unsigned int i = 0 ; i < contours.size() ; i++ ) {
-		contour_endi = contours.at(i);
-		if ( hasDebug ) debug << "new contour starting. startpt index, endpt index:";
-		if ( hasDebug ) debug << contour_starti << "," << contour_endi << "\n";
-		int offset = contour_starti;
-		int npts = contour_endi - contour_starti + 1;
-		if ( hasDebug ) debug << "number of points in this contour: " << npts << "\n";
-		if ( hasDebug ) debug << "moving to first pt " << points[offset].x + offsetX << "," << points[offset].y + offsetY<< "\n";
-		svg << "\n M " << points[contour_starti].x + offsetX << "," << points[contour_starti].y + offsetY << "\n";
-		if ( hasDebug ) debug << "listing pts: [this pt index][isctrl] <next pt index><isctrl> [x,y] <nx,ny>\n";
-		for ( int j = 0; j < npts; j++ ) {
-			int thisi = j%npts + offset;
-			int nexti = (j+1)%npts + offset;
-			int nextnexti = (j+2)%npts + offset;
-			int x = points[thisi].x + offsetX;
-			int y = points[thisi].y + offsetY;
-			int nx = points[nexti].x + offsetX;
-			int ny = points[nexti].y + offsetY;
-			int nnx = points[nextnexti].x + offsetX;
-			int nny = points[nextnexti].y + offsetY;
-			bool this_tagbit1 = (tags[ thisi ] & 1);
-			bool next_tagbit1 = (tags[ nexti ] & 1);
-			bool nextnext_tagbit1 = (tags[ nextnexti ] & 1);
-			bool this_isctl = !this_tagbit1;
-			bool next_isctl = !next_tagbit1;
-			bool nextnext_isctl = !nextnext_tagbit1;
-			if ( hasDebug ) debug << " [" << thisi << "]";
-			if ( hasDebug ) debug << "[" << !this_tagbit1 << "]";
-			if ( hasDebug ) debug << " <" << nexti << ">";
-			if ( hasDebug ) debug << "<" << !next_tagbit1 << ">";
-			if ( hasDebug ) debug << " <<" << nextnexti << ">>";
-			if ( hasDebug ) debug << "<<" << !nextnext_tagbit1 << ">>";
-			if ( hasDebug ) debug << " [" << x << "," << y << "]";
-			if ( hasDebug ) debug << " <" << nx << "," << ny << ">";
-			if ( hasDebug ) debug << " <<" << nnx << "," << nny << ">>";
-			if ( hasDebug ) debug << "\n";
-
-			if (this_isctl && next_isctl) {
-				if ( hasDebug ) debug << " two adjacent ctl pts. adding point halfway between " << thisi << " and " << nexti << ":";
-				if ( hasDebug ) debug << " reseting x and y to ";
-				x = (x + nx) / 2;
-				y = (y + ny) / 2;
-				this_isctl = false;
-				if ( hasDebug ) debug << " [" << x << "," << y <<"]\n";
-				if (j==0) {
-					if ( hasDebug ) debug << "first pt in contour was ctrl pt. moving to non-ctrl pt\n";
-					svg << " M " << x << "," << y << "\n";
-				}
-			}
+/* Axis-aligned affine transform applied to outline points on their way to
+the emitters: x' = sx * x + dx, y' = sy * y + dy. It folds the TrueType to
+SVG y flip (TrueType y grows upwards, SVG y downwards) and the glyph
+offset into one step, so FreeType's outline is never modified. */
+struct affine
+{
+	double sx, sy, dx, dy;
 
-			if (!this_isctl && next_isctl && !nextnext_isctl) {
-			  if ( generateBezierStatements ) {
-			    svg << " Q " << nx << "," << ny << " " << nnx << "," << nny << "\n"; 
-			    if ( hasDebug ) debug << " bezier to " << nnx << "," << nny << " ctlx, ctly: " << nx << "," << ny << "\n";
-			  }
-			  else {
-			    svg << svgQuadraticBezier(fullQuadraticBezier( Point2D(x,y), Point2D(nx, ny),  Point2D(nnx, nny) ));
-			    if ( hasDebug ) debug << " BEZIER INTERPOLATION " << debugQuadraticBezier(fullQuadraticBezier( Point2D(x,y), Point2D(nx, ny),  Point2D(nnx, nny) )) <<  "\n";
-			  }				
-			} else if (!this_isctl && next_isctl && nextnext_isctl) {
-				if ( hasDebug ) debug << " two ctl pts coming. adding point halfway between " << nexti << " and " << nextnexti << ":";
-				if ( hasDebug ) debug << " reseting nnx and nny to halfway pt";
-				nnx = (nx + nnx) / 2;
-				nny = (ny + nny) / 2;
-				if ( generateBezierStatements ) {
-				  svg << " Q " << nx << "," << ny << " " << nnx << "," << nny << "\n";
-				  if ( hasDebug ) debug << " bezier to " << nnx << "," << nny << " ctlx, ctly: " << nx << "," << ny << "\n";
-				}
-				else {
-				  svg << svgQuadraticBezier(fullQuadraticBezier( Point2D(x,y), Point2D(nx, ny),  Point2D(nnx, nny) ));
-				  if ( hasDebug ) debug << " BEZIER INTERPOLATION " << debugQuadraticBezier(fullQuadraticBezier( Point2D(x,y), Point2D(nx, ny),  Point2D(nnx, nny) )) << "\n";
-				}
-			} else if (!this_isctl && !next_isctl) {
-				svg << " L " << nx << "," << ny << "\n";
-				if ( hasDebug ) debug << " line to " << nx << "," << ny << "\n";			
-			} else if (this_isctl && !next_isctl) {
-				if ( hasDebug ) debug << " this is ctrl pt. skipping to " << nx << "," << ny << "\n";
+	affine( double sx = 1.0, double sy = 1.0, double dx = 0.0, double dy = 0.0 )
+		: sx( sx ), sy( sy ), dx( dx ), dy( dy ) {}
+
+	/* Font units to SVG coordinates, scaled then shifted by offsetX / offsetY */
+	static affine svg( double offsetX = 0.0, double offsetY = 0.0, double scale = 1.0 )
+	{
+		return affine( scale, -scale, offsetX, offsetY );
+	}
+
+	double x( double v ) const { return sx * v + dx; }
+	double y( double v ) const { return sy * v + dy; }
+};
+
+/* Walk the contours of a TrueType outline and report them as drawing
+commands: visitor.move(x, y), visitor.line(x, y), visitor.quad(cx, cy, x, y)
+and visitor.close(). Implied on-curve points between two control points
+are resolved exactly, and a contour that starts on a control point starts
+at its last on-curve point (or the implied one) instead. Every contour
+ends with an explicit segment back to its starting point before close().
+Every point goes through the transform 't' as it is read. */
+template <typename Visitor>
+void walk_contours(const FT_Vector *points, const char *tags, const short *contours, int n_contours,
+	const affine &t, Visitor &visitor)
+{
+	int first = 0;
+	for ( int i = 0 ; i < n_contours ; i++ ) {
+		int last = contours[i];
+		if ( last < first ) continue;
+		int begin = first, end = last;
+		double sx, sy;
+		if ( tags[first] & 1 ) {
+			sx = points[first].x; sy = points[first].y;
+			begin = first + 1;
+		} else if ( tags[last] & 1 ) {
+			sx = points[last].x; sy = points[last].y;
+			end = last - 1;
+		} else {
+			sx = ( points[first].x + points[last].x ) / 2.0;
+			sy = ( points[first].y + points[last].y ) / 2.0;
+		}
+		sx = t.x( sx ); sy = t.y( sy );
+		visitor.move( sx, sy );
+		bool pending = false;
+		double cx = 0, cy = 0;
+		for ( int k = begin ; k <= end ; k++ ) {
+			double x = t.x( points[k].x );
+			double y = t.y( points[k].y );
+			if ( tags[k] & 1 ) {
+				if ( pending ) visitor.quad( cx, cy, x, y );
+				else visitor.line( x, y );
+				pending = false;
+			} else {
+				if ( pending ) visitor.quad( cx, cy, ( cx + x ) / 2, ( cy + y ) / 2 );
+				cx = x; cy = y;
+				pending = true;
 			}
 		}
-		contour_starti = contour_endi+1;
-		svg << " Z\n";
+		if ( pending ) visitor.quad( cx, cy, sx, sy );
+		else visitor.line( sx, sy );
+		visitor.close();
+		first = last + 1;
 	}
-	svg << "\n  '/>";
-	if ( hasDebug ) std::cout << "\n<!--\n" << debug.str() << " \n-->\n";
-	return svg.str();
 }
 
-class glyph
+/* A glyph outline owned by the library, independent of FreeType's glyph
+slot: it stays valid after the next FT_Load_Glyph and can be cached, copied
+to other threads or drawn by several emitters. Coordinates are kept in font
+units with y upwards, as in the font; emitters map them to SVG with an
+affine transform.
+
+The drawing commands are in 'cmds' ('M', 'L', 'Q', 'Z') with implied
+on-curve points already resolved; their points are stored in order in
+x[] / y[] (one for M and L, control point then end point for Q, none for
+Z). contour_starts[i] is the index in cmds of contour i's 'M'. The source
+points, their on-curve flags and contour end indexes are kept in px / py /
+on_curve / contour_ends for the point and label emitters.
+*/
+struct outline_ir
 {
-public:
-	int codepoint;
-	FT_GlyphSlot slot;
-	FT_Error error;
-	FT_Outline ftoutline;
-	FT_Glyph_Metrics gm;
-	FT_Face face;
-	ttf_file file;
+	std::vector<char> cmds;
+	std::vector<double> x, y;
+	std::vector<size_t> contour_starts;
 
-	FT_Vector* ftpoints;
-	char* tags;
-	short* contours;
+	std::vector<double> px, py;
+	std::vector<char> on_curve;
+	std::vector<short> contour_ends;
 
-	std::stringstream debug, tmp;
-	int bbwidth, bbheight;
+	double units_per_em; // of the face, 0 if unknown; kept by clear()
 
-  double offsetX, offsetY; //Shift the glyph given the offset
-  double gWidth, gHeight; //Gliph width & height
-  bool generateBezierStatements; //SVG with bezier statements (if false, Bezier transformed as line segments)
-  
-	glyph( ttf_file &f, std::string unicode_str )
+	outline_ir() : units_per_em( 0 ) {}
+
+	void clear()
 	{
-		file = f;
-		init( unicode_str );
+		cmds.clear(); x.clear(); y.clear(); contour_starts.clear();
+		px.clear(); py.clear(); on_curve.clear(); contour_ends.clear();
 	}
 
-	glyph( const char * filename, std::string unicode_str )
+	bool empty() const { return px.empty(); }
+
+	/* Approximate heap memory held by the vectors */
+	size_t bytes() const
 	{
-		this->file = ttf_file( std::string(filename) );
-		init( unicode_str );
+		return cmds.capacity() + ( x.capacity() + y.capacity() + px.capacity() + py.capacity() ) * sizeof( double )
+			+ contour_starts.capacity() * sizeof( size_t ) + on_curve.capacity()
+			+ contour_ends.capacity() * sizeof( short );
+	}
+
+	/* Replace the contents with an outline given as FreeType arrays */
+	void build( const FT_Vector *points, const char *tags, int n_points,
+		const short *contours, int n_contours )
+	{
+		clear();
+		px.resize( n_points );
+		py.resize( n_points );
+		on_curve.resize( n_points );
+		for ( int i = 0 ; i < n_points ; i++ ) {
+			px[i] = points[i].x;
+			py[i] = points[i].y;
+			on_curve[i] = tags[i] & 1;
+		}
+		contour_ends.assign( contours, contours + n_contours );
+		if ( n_points > 0 ) walk_contours( points, tags, contours, n_contours, affine(), *this );
+	}
+
+	void build( const FT_Outline &o )
+	{
+		build( o.points, o.tags, o.n_points, o.contours, o.n_contours );
+	}
+
+	/* Send the commands to a walk_contours style visitor, every point
+	going through the transform 't' */
+	template <typename Visitor>
+	void replay( Visitor &visitor, const affine &t ) const
+	{
+		size_t k = 0;
+		for ( size_t i = 0 ; i < cmds.size() ; i++ ) {
+			switch ( cmds[i] ) {
+			case 'M': visitor.move( t.x( x[k] ), t.y( y[k] ) ); k++; break;
+			case 'L': visitor.line( t.x( x[k] ), t.y( y[k] ) ); k++; break;
+			case 'Q': visitor.quad( t.x( x[k] ), t.y( y[k] ), t.x( x[k+1] ), t.y( y[k+1] ) ); k += 2; break;
+			case 'Z': visitor.close(); break;
+			}
+		}
+	}
+
+	// walk_contours visitor interface, used by build()
+	void move( double mx, double my ) { contour_starts.push_back( cmds.size() ); add( 'M', mx, my ); }
+	void line( double lx, double ly ) { add( 'L', lx, ly ); }
+	void quad( double cx, double cy, double qx, double qy ) { add( 'Q', cx, cy ); x.push_back( qx ); y.push_back( qy ); }
+	void close() { cmds.push_back( 'Z' ); }
+
+private:
+	void add( char cmd, double ax, double ay )
+	{
+		cmds.push_back( cmd );
+		x.push_back( ax );
+		y.push_back( ay );
+	}
+};
+
+/* walk_contours visitor writing the path data of do_outline():
+ "M x,y" then " L x,y", " Q cx,cy x,y" (or " L x y" line segments when
+ Bezier statements are off) and " Z", one command per line. Points after
+ the M are written as whole font units, or with a precision >= 0 every
+ point is rounded to that many decimals. 'tolerance' is in the units the
+ points come in, so callers scale it along with them. */
+struct svg_path_emitter
+{
+	out_buffer *svg;
+	bool generateBezierStatements;
+	double tolerance;
+	double cx, cy;
+	int precision;
+	long unit;
+
+	svg_path_emitter( out_buffer &out, bool generateBezierStatements, double tolerance, int precision = -1 )
+		: svg( &out ), generateBezierStatements( generateBezierStatements ),
+		  tolerance( tolerance ), cx( 0 ), cy( 0 ), precision( precision ),
+		  unit( fixedUnit( precision ) ) {}
+
+	void move( double x, double y )
+	{
+		if ( hasDebug ) debug << "moving to first pt " << x << "," << y << "\n";
+		svg->put("\n M ");
+		if ( precision < 0 ) {
+			svg->put_double(x);
+			svg->put(',');
+			svg->put_double(y);
+		} else {
+			svg->put_fixed(toFixed(x, unit), precision);
+			svg->put(',');
+			svg->put_fixed(toFixed(y, unit), precision);
+		}
+		svg->put('\n');
+		cx = x; cy = y;
+	}
+
+	void line( double x, double y )
+	{
+		if ( hasDebug ) debug << " line to " << (long)x << "," << (long)y << "\n";
+		svg->put(" L");
+		point(x, y);
+		svg->put('\n');
+		cx = x; cy = y;
+	}
+
+	void quad( double x1, double y1, double x2, double y2 )
+	{
+		if ( generateBezierStatements ) {
+			if ( hasDebug ) debug << " bezier to " << (long)x2 << "," << (long)y2 << " ctlx, ctly: " << (long)x1 << "," << (long)y1 << "\n";
+			svg->put(" Q");
+			point(x1, y1);
+			point(x2, y2);
+			svg->put('\n');
+		} else if ( precision >= 0 ) {
+			flattenQuadraticBezier( Point2D( cx, cy ), Point2D( x1, y1 ), Point2D( x2, y2 ),
+				tolerance, segment( this ) );
+		} else {
+			Point2D p0( (long)cx, (long)cy ), p1( (long)x1, (long)y1 ), p2( (long)x2, (long)y2 );
+			flattenQuadraticBezier( p0, p1, p2, tolerance, svgLineTo(*svg) );
+			if ( hasDebug ) debug << " BEZIER INTERPOLATION " << debugQuadraticBezier(flattenQuadraticBezier( p0, p1, p2, tolerance )) << "\n";
+		}
+		cx = x2; cy = y2;
+	}
+
+	void close()
+	{
+		svg->put(" Z\n");
+	}
+
+private:
+	// flattenQuadraticBezier callback, by value so it holds a pointer
+	struct segment {
+		svg_path_emitter *e;
+		segment( svg_path_emitter *e ) : e( e ) {}
+		void operator()( double x, double y ) { e->line( x, y ); }
+	};
+
+	void point( double x, double y )
+	{
+		if ( precision < 0 ) {
+			svgPoint(*svg, (long)x, (long)y);
+			return;
+		}
+		svg->put(' ');
+		svg->put_fixed(toFixed(x, unit), precision);
+		svg->put(',');
+		svg->put_fixed(toFixed(y, unit), precision);
+	}
+};
+
+/* How coordinates are written in compact path data */
+enum path_coords {
+	coords_absolute,  // M L H V Q T, absolute positions
+	coords_relative,  // m l h v q t, offsets from the current point
+	coords_shortest   // per command, whichever of the two is shorter
+};
+
+/* Everything that decides what do_outline() writes for an outline */
+struct outline_options
+{
+	double offsetX, offsetY;       // shift of the glyph
+	bool generateBezierStatements; // Q statements, or curves as line segments
+	double tolerance;              // max distance from the curve for line segments, in font units
+	bool compact;                  // minified path data, see svg_compact_path_emitter
+	path_coords coords;            // coordinate form used by compact path data
+	double emSize;                 // output units per em, 0 for font units
+	int precision;                 // decimals written, 0..maxPrecision
+
+	outline_options()
+		: offsetX( 0.0 ), offsetY( 0.0 ), generateBezierStatements( true ),
+		  tolerance( defaultTolerance ), compact( false ), coords( coords_shortest ),
+		  emSize( 0.0 ), precision( 0 ) {}
+
+	/* Font units to output units for a face with the given units per em */
+	double scale( double units_per_em ) const
+	{
+		return emSize > 0 && units_per_em > 0 ? emSize / units_per_em : 1.0;
+	}
+
+	/* 'tolerance' in output units, which is what flattening works in */
+	double scaled_tolerance( double units_per_em ) const
+	{
+		return tolerance * scale( units_per_em );
+	}
+
+	int decimals() const
+	{
+		return precision < 0 ? 0 : precision > maxPrecision ? maxPrecision : precision;
+	}
+
+	/* Hash of every field that changes the output */
+	uint64_t hash() const
+	{
+		int32_t c = coords, d = decimals();
+		unsigned char flags = ( generateBezierStatements ? 1 : 0 ) | ( compact ? 2 : 0 );
+		uint64_t h = fnv1a( &offsetX, sizeof( offsetX ) );
+		h = fnv1a( &offsetY, sizeof( offsetY ), h );
+		h = fnv1a( &flags, 1, h );
+		if ( !generateBezierStatements ) h = fnv1a( &tolerance, sizeof( tolerance ), h );
+		if ( compact ) h = fnv1a( &c, sizeof( c ), h );
+		h = fnv1a( &emSize, sizeof( emSize ), h );
+		return fnv1a( &d, sizeof( d ), h );
+	}
+};
+
+/* walk_contours visitor writing minified path data: coordinates rounded to
+outline_options::decimals() places and kept in fixed point, a command letter only when it changes (implicit repetition,
+including lines after a move), H/V for horizontal and vertical lines, T for
+curves whose control point is the reflection of the previous one, no
+line back to the start before Z, and a separator only where the next
+number does not start with '-' (or with '.' after a number that has one).
+
+Coordinates are absolute, relative, or with coords_shortest chosen per
+command: both forms are costed in characters (letter, separators, digits)
+against the current writer state and the shorter is written, relative on
+a tie. The choice is local, so there is no second pass. */
+struct svg_compact_path_emitter
+{
+	out_buffer *svg;
+	const outline_options *opt;
+	double tolerance; // opt->tolerance in output units
+	int decimals;     // digits after the point
+	long unit;        // 10^decimals, all positions below are in these steps
+	long cx, cy;      // current point, as written
+	long sx, sy;      // start of the current subpath
+	long qx, qy;      // control point of the last curve
+	bool smooth;      // last command was a curve, so T may follow
+	char last;        // last command letter (implicit or not)
+	bool sep;         // a number was just written
+	bool dot;         // ... and it has a decimal point
+	bool close_line;  // a line back to (sx,sy) is waiting for Z
+
+	/* 'scale' is the one the points are mapped with, for the tolerance */
+	svg_compact_path_emitter( out_buffer &out, const outline_options &options, double scale = 1.0 )
+		: svg( &out ), opt( &options ), tolerance( options.tolerance * scale ), decimals( options.decimals() ),
+		  unit( fixedUnit( decimals ) ), cx( 0 ), cy( 0 ), sx( 0 ), sy( 0 ),
+		  qx( 0 ), qy( 0 ), smooth( false ), last( 0 ), sep( false ), dot( false ),
+		  close_line( false ) {}
+
+	long round( double v ) const { return toFixed( v, unit ); }
+
+	void move( double x, double y )
+	{
+		close_line = false;
+		long X = round( x ), Y = round( y );
+		long abs[2] = { X, Y };
+		long rel[2] = { X - cx, Y - cy };
+		emit( 'm', abs, rel, 2 );
+		cx = sx = X;
+		cy = sy = Y;
+		smooth = false;
+	}
+
+	void line( double x, double y )
+	{
+		line_to( round( x ), round( y ) );
+	}
+
+	void quad( double x1, double y1, double x2, double y2 )
+	{
+		if ( !opt->generateBezierStatements ) {
+			flattenQuadraticBezier( Point2D( (double)cx / unit, (double)cy / unit ),
+				Point2D( x1, y1 ), Point2D( x2, y2 ), tolerance, segment( this ) );
+			return;
+		}
+		flush();
+		long CX = round( x1 ), CY = round( y1 ), X = round( x2 ), Y = round( y2 );
+		if ( smooth && CX == 2 * cx - qx && CY == 2 * cy - qy ) {
+			long abs[2] = { X, Y };
+			long rel[2] = { X - cx, Y - cy };
+			emit( 't', abs, rel, 2 );
+		} else {
+			long abs[4] = { CX, CY, X, Y };
+			long rel[4] = { CX - cx, CY - cy, X - cx, Y - cy };
+			emit( 'q', abs, rel, 4 );
+		}
+		qx = CX; qy = CY;
+		cx = X; cy = Y;
+		smooth = true;
+	}
+
+	void close()
+	{
+		close_line = false;
+		svg->put( 'z' );
+		sep = dot = false;
+		last = 'z';
+		cx = sx; cy = sy;
+		smooth = false;
+	}
+
+private:
+	// flattenQuadraticBezier callback, by value so it holds a pointer
+	struct segment {
+		svg_compact_path_emitter *e;
+		segment( svg_compact_path_emitter *e ) : e( e ) {}
+		void operator()( double x, double y ) { e->line( x, y ); }
+	};
+
+	void line_to( long X, long Y )
+	{
+		flush();
+		if ( X == cx && Y == cy ) return;
+		if ( X == sx && Y == sy ) {
+			close_line = true;  // Z draws it, unless more follows
+			return;
+		}
+		write_line( X, Y );
+	}
+
+	void flush()
+	{
+		if ( !close_line ) return;
+		close_line = false;
+		write_line( sx, sy );
+	}
+
+	void write_line( long X, long Y )
+	{
+		if ( Y == cy ) {
+			long abs = X, rel = X - cx;
+			emit( 'h', &abs, &rel, 1 );
+		} else if ( X == cx ) {
+			long abs = Y, rel = Y - cy;
+			emit( 'v', &abs, &rel, 1 );
+		} else {
+			long abs[2] = { X, Y };
+			long rel[2] = { X - cx, Y - cy };
+			emit( 'l', abs, rel, 2 );
+		}
+		cx = X; cy = Y;
+		smooth = false;
+	}
+
+	// The letter is omitted when it repeats, or is a line right after a move
+	bool implicit( char c ) const
+	{
+		return c == last || ( c == 'l' && last == 'm' ) || ( c == 'L' && last == 'M' );
+	}
+
+	// Length of put_fixed( v, decimals ), whether it starts with '.' and has one
+	int length( long v, bool &leading_dot, bool &has_dot ) const
+	{
+		unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+		unsigned long ip = u / unit, fp = u % unit;
+		int n = v < 0 ? 1 : 0;
+		int d = decimals;
+		while ( fp && fp % 10 == 0 ) { fp /= 10; d--; }
+		has_dot = fp != 0;
+		leading_dot = has_dot && !ip && v > 0;
+		if ( has_dot ) n += 1 + d;
+		if ( ip || !fp ) {
+			n++;
+			while ( ip >= 10 ) { ip /= 10; n++; }
+		}
+		return n;
+	}
+
+	// A separator is needed unless the number starts with '-', or with '.'
+	// right after a number that already has a point
+	static bool separator( bool after_number, bool after_dot, long v, bool leading_dot )
+	{
+		return after_number && v >= 0 && !( leading_dot && after_dot );
+	}
+
+	// Characters written for command c with arguments v
+	int cost( char c, const long *v, int n ) const
+	{
+		bool s = sep, d = dot;
+		int len = 0;
+		if ( !implicit( c ) ) { len++; s = d = false; }
+		for ( int i = 0 ; i < n ; i++ ) {
+			bool leading_dot, has_dot;
+			len += length( v[i], leading_dot, has_dot );
+			if ( separator( s, d, v[i], leading_dot ) ) len++;
+			s = true;
+			d = has_dot;
+		}
+		return len;
+	}
+
+	// Write command c (lowercase) in the form picked by opt->coords
+	void emit( char c, const long *abs, const long *rel, int n )
+	{
+		char C = c - 'a' + 'A';
+		bool relative;
+		switch ( opt->coords ) {
+		case coords_absolute: relative = false; break;
+		case coords_relative: relative = true; break;
+		default: relative = cost( c, rel, n ) <= cost( C, abs, n ); break;
+		}
+		if ( relative ) write( c, rel, n );
+		else write( C, abs, n );
+	}
+
+	void write( char c, const long *v, int n )
+	{
+		if ( !implicit( c ) ) {
+			svg->put( c );
+			sep = dot = false;
+		}
+		last = c;
+		for ( int i = 0 ; i < n ; i++ ) {
+			bool leading_dot, has_dot;
+			if ( decimals == 0 ) {
+				leading_dot = has_dot = false;
+			} else {
+				length( v[i], leading_dot, has_dot );
+			}
+			if ( separator( sep, dot, v[i], leading_dot ) ) svg->put( ' ' );
+			svg->put_fixed( v[i], decimals );
+			sep = true;
+			dot = has_dot;
+		}
+	}
+};
+
+  void svgPathHeader(out_buffer &svg);
+
+  void svgPathFooter(out_buffer &svg);
+
+/* Draw the outline of the font as svg.
+There are three main components.
+1. the points
+2. the 'tags' for the points
+3. the contour indexes (that define which points belong to which contour)
+4,5. offset on X and Y -> translation
+6. SVG output with Bezier statements (otherwise interpolate and generate only line segments)
+7. for line segments, the largest distance allowed from the real curve
+The svg text is appended to 'svg'. The arrays are read in place (they can be
+the ones of an FT_Outline) and nothing else is allocated or written.
+
+tag bit 1 indicates whether its a control point on a bez curve or not. two
+consecutive control points imply another point halfway between them; see
+walk_contours(). The points are taken as they are (y downwards), only
+translated by the offsets.
+*/
+  void do_outline(const FT_Vector *points, const char *tags, int n_points, const short *contours, int n_contours, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance = defaultTolerance);
+
+/* Only the path data (the d attribute) of an outline_ir, verbose or
+compact as options say, with the points mapped by 't' instead of the
+usual flip, scale and offsets. Writes nothing for an empty outline. */
+  void do_path_data(const outline_ir &ir, const outline_options &options, const affine &t, out_buffer &svg);
+
+/* The same in SVG coordinates: y flipped, scaled and offset as options say */
+  void do_path_data(const outline_ir &ir, const outline_options &options, out_buffer &svg);
+
+/* The same, drawn from an outline_ir in font units: y is flipped, the
+outline scaled to options.emSize (when set and ir.units_per_em is known)
+and the offsets, in output units, added on the fly. With options.compact the path data is minified
+and the path element has no comment or line breaks. */
+  void do_outline(const outline_ir &ir, const outline_options &options, out_buffer &svg);
+
+  void do_outline(const outline_ir &ir, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance = defaultTolerance);
+
+  void do_outline(const std::vector<FT_Vector> &points, const std::vector<char> &tags, const std::vector<short> &contours, double offsetX, double offsetY, bool generateBezierStatements, out_buffer &svg, double tolerance = defaultTolerance);
+
+  std::string do_outline(const std::vector<FT_Vector> &points, const std::vector<char> &tags, const std::vector<short> &contours, double offsetX, double offsetY, bool generateBezierStatements = true, double tolerance = defaultTolerance);
+
+/* Quadratic Bezier curves waiting to be flattened, as structure of arrays.
+Curve s goes from (x0,y0) through control point (x1,y1) to (x2,y2), is cut
+into n[s] line segments and writes its n[s] points (t = 1/n .. 1) starting
+at output index first[s]. */
+struct quad_batch
+{
+	std::vector<double> x0, y0, x1, y1, x2, y2;
+	std::vector<int> n;
+	std::vector<size_t> first;
+
+	size_t size() const { return n.size(); }
+
+	void clear()
+	{
+		x0.clear(); y0.clear(); x1.clear(); y1.clear(); x2.clear(); y2.clear();
+		n.clear(); first.clear();
+	}
+
+	void add( const Point2D &p0, const Point2D &p1, const Point2D &p2, int segments, size_t start )
+	{
+		x0.push_back( p0.x ); y0.push_back( p0.y );
+		x1.push_back( p1.x ); y1.push_back( p1.y );
+		x2.push_back( p2.x ); y2.push_back( p2.y );
+		n.push_back( segments );
+		first.push_back( start );
+	}
+};
+
+/* Evaluate every curve of a quad_batch into the x[] / y[] output arrays.
+Each point is computed directly as p0 + t (b + t a), so the samples of a
+curve are independent and are evaluated 4 (AVX) or 2 (SSE2) at a time,
+with a scalar loop for the rest. The last point of each curve is its
+exact end point. */
+inline void flattenQuadraticBatch( const quad_batch &q, double *x, double *y )
+{
+	for ( size_t s = 0 ; s < q.size() ; s++ ) {
+		int n = q.n[s];
+		double h = 1.0 / n;
+		double ax = q.x0[s] - 2 * q.x1[s] + q.x2[s], ay = q.y0[s] - 2 * q.y1[s] + q.y2[s];
+		double bx = 2 * ( q.x1[s] - q.x0[s] ), by = 2 * ( q.y1[s] - q.y0[s] );
+		double *ox = x + q.first[s], *oy = y + q.first[s];
+		int k = 0;
+#if defined(__AVX__)
+		__m256d vh = _mm256_set1_pd( h );
+		__m256d vax = _mm256_set1_pd( ax ), vay = _mm256_set1_pd( ay );
+		__m256d vbx = _mm256_set1_pd( bx ), vby = _mm256_set1_pd( by );
+		__m256d vx0 = _mm256_set1_pd( q.x0[s] ), vy0 = _mm256_set1_pd( q.y0[s] );
+		__m256d vk = _mm256_set_pd( 4, 3, 2, 1 ), step = _mm256_set1_pd( 4 );
+		for ( ; k + 4 <= n ; k += 4 ) {
+			__m256d t = _mm256_mul_pd( vk, vh );
+			_mm256_storeu_pd( ox + k, _mm256_add_pd( vx0, _mm256_mul_pd( t, _mm256_add_pd( vbx, _mm256_mul_pd( t, vax ) ) ) ) );
+			_mm256_storeu_pd( oy + k, _mm256_add_pd( vy0, _mm256_mul_pd( t, _mm256_add_pd( vby, _mm256_mul_pd( t, vay ) ) ) ) );
+			vk = _mm256_add_pd( vk, step );
+		}
+#elif defined(__SSE2__)
+		__m128d vh = _mm_set1_pd( h );
+		__m128d vax = _mm_set1_pd( ax ), vay = _mm_set1_pd( ay );
+		__m128d vbx = _mm_set1_pd( bx ), vby = _mm_set1_pd( by );
+		__m128d vx0 = _mm_set1_pd( q.x0[s] ), vy0 = _mm_set1_pd( q.y0[s] );
+		__m128d vk = _mm_set_pd( 2, 1 ), step = _mm_set1_pd( 2 );
+		for ( ; k + 2 <= n ; k += 2 ) {
+			__m128d t = _mm_mul_pd( vk, vh );
+			_mm_storeu_pd( ox + k, _mm_add_pd( vx0, _mm_mul_pd( t, _mm_add_pd( vbx, _mm_mul_pd( t, vax ) ) ) ) );
+			_mm_storeu_pd( oy + k, _mm_add_pd( vy0, _mm_mul_pd( t, _mm_add_pd( vby, _mm_mul_pd( t, vay ) ) ) ) );
+			vk = _mm_add_pd( vk, step );
+		}
+#endif
+		for ( ; k < n ; k++ ) {
+			double t = ( k + 1 ) * h;
+			ox[k] = q.x0[s] + t * ( bx + t * ax );
+			oy[k] = q.y0[s] + t * ( by + t * ay );
+		}
+		ox[n-1] = q.x2[s];
+		oy[n-1] = q.y2[s];
+	}
+}
+
+/* A glyph outline flattened to polylines, as structure of arrays. Point k
+is (x[k], y[k]); contour i is the polyline of points [contour_ends[i-1],
+contour_ends[i]) (starting at 0 for the first), whose last point is its
+first one again. */
+struct flat_outline
+{
+	std::vector<double> x, y;
+	std::vector<size_t> contour_ends;
+	quad_batch curves;  // scratch, kept to reuse its storage
+
+	void clear()
+	{
+		x.clear(); y.clear(); contour_ends.clear(); curves.clear();
+	}
+};
+
+/* walk_contours visitor that lays out a flat_outline: straight points are
+stored right away, curves reserve their output points in a quad_batch */
+struct flat_outline_builder
+{
+	flat_outline *out;
+	double tolerance;
+	double cx, cy;
+
+	void move( double x, double y ) { point( x, y ); }
+	void line( double x, double y ) { point( x, y ); }
+	void quad( double x1, double y1, double x2, double y2 )
+	{
+		Point2D p0( cx, cy ), p1( x1, y1 ), p2( x2, y2 );
+		int n = quadraticBezierSegments( p0, p1, p2, tolerance );
+		out->curves.add( p0, p1, p2, n, out->x.size() );
+		out->x.resize( out->x.size() + n );
+		out->y.resize( out->y.size() + n );
+		cx = x2; cy = y2;
+	}
+	void close() { out->contour_ends.push_back( out->x.size() ); }
+	void point( double x, double y )
+	{
+		out->x.push_back( x );
+		out->y.push_back( y );
+		cx = x; cy = y;
+	}
+};
+
+/* Flatten a whole glyph outline into 'out' (which is cleared first), every
+curve within 'tolerance' of the real one. */
+inline void flatten_outline( const FT_Vector *points, const char *tags, int n_points,
+	const short *contours, int n_contours, double offsetX, double offsetY,
+	double tolerance, flat_outline &out )
+{
+	out.clear();
+	if ( n_points == 0 ) return;
+	flat_outline_builder b;
+	b.out = &out;
+	b.tolerance = tolerance;
+	b.cx = b.cy = 0;
+	walk_contours( points, tags, contours, n_contours, affine( 1.0, 1.0, offsetX, offsetY ), b );
+	if ( !out.x.empty() ) flattenQuadraticBatch( out.curves, &out.x[0], &out.y[0] );
+}
+
+/* The same from an outline_ir, mapped through 't' (affine::svg() gives the
+coordinates of do_outline) */
+inline void flatten_outline( const outline_ir &ir, const affine &t,
+	double tolerance, flat_outline &out )
+{
+	out.clear();
+	flat_outline_builder b;
+	b.out = &out;
+	b.tolerance = tolerance;
+	b.cx = b.cy = 0;
+	ir.replay( b, t );
+	if ( !out.x.empty() ) flattenQuadraticBatch( out.curves, &out.x[0], &out.y[0] );
+}
+
+/* Identifies one converted outline: which font file (by content), which
+glyph, and the options it was drawn with. */
+struct cache_key
+{
+	uint64_t font;        // ttf_file::hash(), or face_id() for glyph_cache
+	int64_t face_index;
+	uint32_t glyph_index;
+	uint64_t options;     // outline_options::hash()
+
+	cache_key() : font( 0 ), face_index( 0 ), glyph_index( 0 ), options( 0 ) {}
+
+	cache_key( uint64_t font, long face_index, FT_UInt glyph_index )
+		: font( font ), face_index( face_index ), glyph_index( glyph_index ), options( 0 ) {}
+
+	cache_key( uint64_t font, long face_index, FT_UInt glyph_index, const outline_options &o )
+		: font( font ), face_index( face_index ), glyph_index( glyph_index ), options( o.hash() ) {}
+
+	bool operator<( const cache_key &k ) const
+	{
+		if ( font != k.font ) return font < k.font;
+		if ( face_index != k.face_index ) return face_index < k.face_index;
+		if ( glyph_index != k.glyph_index ) return glyph_index < k.glyph_index;
+		return options < k.options;
+	}
+};
+
+/* Persistent cache of converted outlines, shared across runs and processes.
+
+The file is a 16 byte header followed by records appended one after the
+other: a fixed header (key, length, checksum) and the outline bytes. It is
+memory-mapped for reading and indexed in memory when opened; records that
+other processes append later are picked up on a miss. Appends and the
+opening scan hold an exclusive flock(), so a torn record left by a crash
+can only be at the end, where it is cut off the next time the file is
+opened. Entries are never replaced or removed; delete the file to empty
+the cache.
+
+Lookups take a mutex, so one disk_cache can be shared by threads. Without
+POSIX file APIs the cache stays closed and every lookup misses. */
+class disk_cache
+{
+public:
+	disk_cache( const std::string &path )
+		: fd( -1 ), map( NULL ), map_len( 0 ), indexed( 0 )
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		fd = ::open( path.c_str(), O_RDWR | O_CREAT, 0644 );
+		if ( fd < 0 ) return;
+		flock( fd, LOCK_EX );
+		struct stat st;
+		char magic[magic_length];
+		bool fresh = fstat( fd, &st ) != 0 || (size_t)st.st_size < magic_length
+			|| pread( fd, magic, magic_length, 0 ) != (ssize_t)magic_length
+			|| memcmp( magic, file_magic(), magic_length ) != 0;
+		if ( fresh ) {
+			// new, or written by another version: start over
+			if ( ftruncate( fd, 0 ) != 0
+				|| pwrite( fd, file_magic(), magic_length, 0 ) != (ssize_t)magic_length ) {
+				flock( fd, LOCK_UN );
+				::close( fd );
+				fd = -1;
+				return;
+			}
+		}
+		indexed = magic_length;
+		if ( scan() < file_size() && ftruncate( fd, indexed ) != 0 ) {
+			flock( fd, LOCK_UN );
+			::close( fd );
+			fd = -1;
+			return;
+		}
+		flock( fd, LOCK_UN );
+#else
+		(void)path;
+#endif
+	}
+
+	~disk_cache()
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		if ( map ) munmap( const_cast<char *>( map ), map_len );
+		if ( fd >= 0 ) ::close( fd );
+#endif
+	}
+
+	bool ok() const { return fd >= 0; }
+
+	/* Append the cached outline for 'key' to 'out'; false on a miss */
+	bool lookup( const cache_key &key, out_buffer &out )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		if ( fd < 0 ) return false;
+		std::map<cache_key, record_ref>::iterator it = index.find( key );
+		if ( it == index.end() ) {
+#if defined(__unix__) || defined(__APPLE__)
+			if ( file_size() == indexed ) return false;
+			flock( fd, LOCK_SH );
+			scan();
+			flock( fd, LOCK_UN );
+			it = index.find( key );
+			if ( it == index.end() ) return false;
+#else
+			return false;
+#endif
+		}
+		if ( !mapped( it->second.offset + it->second.length ) ) return false;
+		out.put( map + it->second.offset, it->second.length );
+		return true;
+	}
+
+	/* Record the outline for 'key'. Keys already present are left alone. */
+	void store( const cache_key &key, const char *data, size_t n )
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		std::lock_guard<std::mutex> guard( lock );
+		if ( fd < 0 || n > 0xffffffffUL || index.count( key ) ) return;
+		record r;
+		r.magic = record_magic;
+		r.length = (uint32_t)n;
+		r.font = key.font;
+		r.face_index = key.face_index;
+		r.options = key.options;
+		r.glyph_index = key.glyph_index;
+		r.check = 0;
+		r.check = checksum( r, data );
+		std::vector<char> bytes( sizeof( r ) + n );
+		memcpy( &bytes[0], &r, sizeof( r ) );
+		if ( n ) memcpy( &bytes[sizeof( r )], data, n );
+
+		flock( fd, LOCK_EX );
+		scan(); // other processes' records, so ours goes after them
+		if ( !index.count( key ) && pwrite( fd, &bytes[0], bytes.size(), indexed ) == (ssize_t)bytes.size() ) {
+			index[key] = record_ref( indexed + sizeof( r ), n );
+			indexed += bytes.size();
+		}
+		flock( fd, LOCK_UN );
+#else
+		(void)key; (void)data; (void)n;
+#endif
+	}
+
+	/* Number of indexed outlines */
+	size_t size()
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		return index.size();
+	}
+
+private:
+	disk_cache( const disk_cache & );
+	disk_cache & operator=( const disk_cache & );
+
+	static const char * file_magic() { return "font2svg cache 1"; }
+	static const size_t magic_length = 16;
+	static const uint32_t record_magic = 0x53325646; // "FV2S"
+
+	struct record
+	{
+		uint32_t magic;
+		uint32_t length;
+		uint64_t font;
+		int64_t face_index;
+		uint64_t options;
+		uint32_t glyph_index;
+		uint32_t check;
+	};
+
+	struct record_ref
+	{
+		size_t offset, length;
+		record_ref( size_t offset = 0, size_t length = 0 ) : offset( offset ), length( length ) {}
+	};
+
+	static uint32_t checksum( const record &r, const char *data )
+	{
+		uint64_t h = fnv1a( &r, sizeof( r ) );
+		h = fnv1a( data, r.length, h );
+		return (uint32_t)( h ^ ( h >> 32 ) );
+	}
+
+	size_t file_size()
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		struct stat st;
+		return fstat( fd, &st ) == 0 ? (size_t)st.st_size : 0;
+#else
+		return 0;
+#endif
+	}
+
+	// Map at least the first 'need' bytes of the file
+	bool mapped( size_t need )
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		if ( need <= map_len ) return true;
+		size_t len = file_size();
+		if ( len < need ) return false;
+		if ( map ) munmap( const_cast<char *>( map ), map_len );
+		void *addr = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 );
+		if ( addr == MAP_FAILED ) {
+			map = NULL;
+			map_len = 0;
+			return false;
+		}
+		map = static_cast<const char *>( addr );
+		map_len = len;
+		return true;
+#else
+		(void)need;
+		return false;
+#endif
+	}
+
+	// Index the complete records after 'indexed'; returns where it stopped
+	size_t scan()
+	{
+		size_t end = file_size();
+		if ( end <= indexed || !mapped( end ) ) return indexed;
+		while ( indexed + sizeof( record ) <= end ) {
+			record r;
+			memcpy( &r, map + indexed, sizeof( r ) );
+			const char *data = map + indexed + sizeof( r );
+			if ( r.magic != record_magic || r.length > end - indexed - sizeof( r ) ) break;
+			uint32_t check = r.check;
+			r.check = 0;
+			if ( checksum( r, data ) != check ) break;
+			cache_key key;
+			key.font = r.font;
+			key.face_index = r.face_index;
+			key.glyph_index = r.glyph_index;
+			key.options = r.options;
+			index[key] = record_ref( indexed + sizeof( r ), r.length );
+			indexed += sizeof( r ) + r.length;
+		}
+		return indexed;
+	}
+
+	std::mutex lock;
+	int fd;
+	const char *map;
+	size_t map_len;
+	size_t indexed;  // end of the last record in the index
+	std::map<cache_key, record_ref> index;
+};
+
+/* A decoded glyph: its outline in font units and FreeType's metrics */
+struct cached_glyph
+{
+	outline_ir ir;
+	FT_Glyph_Metrics metrics;
+};
+
+/* Bounded, thread-safe LRU cache of decoded glyphs.
+
+Decoded outlines do not depend on the emitter options, so entries are
+keyed by face and glyph only (cache_key::options is 0) and one entry
+serves every offset, mode and precision the glyph is later drawn with.
+The face is identified by ttf_file::face_id() rather than its content
+hash: nothing is hashed, and ids are never reused, so entries of a font
+that has been closed and changed on disk are simply never found again.
+When the entries' approximate memory use goes over 'budget' bytes the
+least recently used ones are dropped. Lookups hand out shared pointers,
+so an entry stays valid for its users after it has been evicted. */
+class glyph_cache
+{
+public:
+	glyph_cache( size_t budget = 16 << 20 )
+		: budget( budget ), used( 0 ), hit_count( 0 ), miss_count( 0 ), evict_count( 0 ) {}
+
+	/* The entry for 'key' (now the most recently used), or an empty pointer */
+	std::shared_ptr<const cached_glyph> find( const cache_key &key )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		std::map<cache_key, entry_list::iterator>::iterator it = index.find( key );
+		if ( it == index.end() ) {
+			miss_count++;
+			return std::shared_ptr<const cached_glyph>();
+		}
+		hit_count++;
+		entries.splice( entries.begin(), entries, it->second );
+		return it->second->glyph;
+	}
+
+	void insert( const cache_key &key, const outline_ir &ir, const FT_Glyph_Metrics &metrics )
+	{
+		std::shared_ptr<cached_glyph> g( new cached_glyph );
+		g->ir = ir;
+		g->metrics = metrics;
+		size_t bytes = sizeof( cached_glyph ) + sizeof( entry ) + g->ir.bytes();
+		std::lock_guard<std::mutex> guard( lock );
+		if ( index.count( key ) || bytes > budget ) return;
+		entries.push_front( entry( key, g, bytes ) );
+		index[key] = entries.begin();
+		used += bytes;
+		while ( used > budget ) {
+			used -= entries.back().bytes;
+			index.erase( entries.back().key );
+			entries.pop_back();
+			evict_count++;
+		}
+	}
+
+	/* Change the budget, evicting as needed */
+	void resize( size_t new_budget )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		budget = new_budget;
+		while ( used > budget && !entries.empty() ) {
+			used -= entries.back().bytes;
+			index.erase( entries.back().key );
+			entries.pop_back();
+			evict_count++;
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		entries.clear();
+		index.clear();
+		used = 0;
+	}
+
+	size_t size() { std::lock_guard<std::mutex> guard( lock ); return entries.size(); }
+	size_t bytes() { std::lock_guard<std::mutex> guard( lock ); return used; }
+	size_t hits() { std::lock_guard<std::mutex> guard( lock ); return hit_count; }
+	size_t misses() { std::lock_guard<std::mutex> guard( lock ); return miss_count; }
+	size_t evictions() { std::lock_guard<std::mutex> guard( lock ); return evict_count; }
+
+private:
+	glyph_cache( const glyph_cache & );
+	glyph_cache & operator=( const glyph_cache & );
+
+	struct entry
+	{
+		cache_key key;
+		std::shared_ptr<const cached_glyph> glyph;
+		size_t bytes;
+		entry( const cache_key &key, const std::shared_ptr<const cached_glyph> &glyph, size_t bytes )
+			: key( key ), glyph( glyph ), bytes( bytes ) {}
+	};
+	typedef std::list<entry> entry_list;
+
+	std::mutex lock;
+	size_t budget, used;
+	size_t hit_count, miss_count, evict_count;
+	entry_list entries; // most recently used first
+	std::map<cache_key, entry_list::iterator> index;
+};
+
+/* A glyph index given to glyph's constructors, to tell it apart from
+codepoint strings: glyph( font, glyph_id( 3 ) ) */
+struct glyph_id
+{
+	FT_UInt index;
+	explicit glyph_id( FT_UInt index ) : index( index ) {}
+};
+
+class glyph
+{
+public:
+	int codepoint; // -1 when built from a glyph_id
+	FT_UInt glyph_index;
+	FT_GlyphSlot slot;
+	FT_Error error;
+	FT_Outline ftoutline;
+	FT_Glyph_Metrics gm;
+	FT_Face face;
+	ttf_file file;
+
+	// These point into the face's glyph slot (in font units, y upwards) and
+	// are only valid until the next glyph is loaded into that face, by any
+	// ttf_file or thread; 'ir' is the glyph's own copy.
+	FT_Vector* ftpoints;
+	char* tags;
+	short* contours;
+	outline_ir ir;
+
+	std::stringstream debug;
+	int bbwidth, bbheight;
+
+  double offsetX, offsetY; //Shift the glyph given the offset
+  double gWidth, gHeight; //Gliph width & height
+  bool generateBezierStatements; //SVG with bezier statements (if false, Bezier transformed as line segments)
+  double tolerance; //Max distance from the curve when Bezier are transformed as line segments
+  bool compact; //Minified path data (see svg_compact_path_emitter)
+  path_coords coords; //Relative, absolute or per-command shortest coordinates in compact path data
+  double emSize; //Output units per em (0: font units, no scaling), for the outline and every other piece
+  int precision; //Decimals written for scaled or compact output
+  
+	glyph( ttf_file &f, std::string unicode_str )
+	{
+		file = f;
+		init( unicode_str );
+	}
+
+	glyph( const char * filename, std::string unicode_str )
+	{
+		this->file = ttf_file( std::string(filename) );
+		init( unicode_str );
 	}
 
 	glyph( const char * filename, const char * unicode_c_str )
 	{
-		this->file = ttf_file( std::string(filename) );
-		init( std::string(unicode_c_str) );
+		this->file = ttf_file( std::string(filename) );
+		init( std::string(unicode_c_str) );
+	}
+
+  glyph( ttf_file &f, const char * unicode_c_str, double offsetX, double offsetY, bool generateBezierStatements, double tolerance = defaultTolerance )
+	{
+		file = f;
+		init( std::string(unicode_c_str), offsetX, offsetY, generateBezierStatements, tolerance );
+	}
+
+  glyph( const char * filename, const char * unicode_c_str, double offsetX, double offsetY, bool generateBezierStatements, double tolerance = defaultTolerance )
+	{
+		this->file = ttf_file( std::string(filename) );
+		init( std::string(unicode_c_str), offsetX, offsetY, generateBezierStatements, tolerance );
+	}
+
+	/* Decoded through 'cache': a glyph already in it is not loaded again,
+	and then the slot fields (slot outline, ftpoints, tags, contours) are
+	left empty; ir and gm are filled in either way. */
+  glyph( glyph_cache &cache, ttf_file &f, const char * unicode_c_str, double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true, double tolerance = defaultTolerance )
+	{
+		file = f;
+		init( std::string(unicode_c_str), offsetX, offsetY, generateBezierStatements, tolerance, &cache );
+	}
+
+	/* By glyph index, for glyphs the cmap does not reach (ligatures,
+	alternates, .notdef) and whole-font dumps */
+  glyph( ttf_file &f, glyph_id id, double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true, double tolerance = defaultTolerance )
+	{
+		file = f;
+		codepoint = -1;
+		load( id.index, offsetX, offsetY, generateBezierStatements, tolerance, NULL );
+	}
+
+  glyph( glyph_cache &cache, ttf_file &f, glyph_id id, double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true, double tolerance = defaultTolerance )
+	{
+		file = f;
+		codepoint = -1;
+		load( id.index, offsetX, offsetY, generateBezierStatements, tolerance, &cache );
+	}
+
+  
+	void free()
+	{
+		file.free();
+	}
+
+  void init( std::string unicode_s, double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true, double tolerance = defaultTolerance, glyph_cache *cache = NULL)
+	{
+		codepoint = strtol( unicode_s.c_str() , NULL, 0 );
+		if ( hasDebug ) debug << "<!--\nUnicode requested: " << unicode_s;
+		if ( hasDebug ) debug << " (decimal: " << codepoint << " hex: 0x"
+			<< std::hex << codepoint << std::dec << ")";
+		face_lock guard = file.lock_face();
+		load( FT_Get_Char_Index( file.face, codepoint ), offsetX, offsetY, generateBezierStatements, tolerance, cache );
+	}
+
+	/* Load glyph 'index' into the face's glyph slot (or take it from
+	'cache') and set up the emitter options */
+  void load( FT_UInt index, double offsetX, double offsetY, bool generateBezierStatements, double tolerance, glyph_cache *cache )
+	{
+	  this->offsetX = offsetX;
+	  this->offsetY = offsetY;
+	  this->generateBezierStatements = generateBezierStatements;
+	  this->tolerance = tolerance;
+	  this->compact = false;
+	  this->coords = coords_shortest;
+	  this->emSize = 0.0;
+	  this->precision = 0;
+	  
+		face_lock guard = file.lock_face();
+		face = file.face;
+		// Load the Glyph into the face's Glyph Slot + print details
+		glyph_index = index;
+		if ( hasDebug && codepoint < 0 ) debug << "<!--";
+		if ( hasDebug ) debug << ( codepoint < 0 ? "\nGlyph index: " : "\nGlyph index for unicode: " ) << glyph_index;
+		std::shared_ptr<const cached_glyph> hit;
+		cache_key key;
+		if ( !file.face_id() ) cache = NULL;
+		if ( cache ) {
+			key = cache_key( file.face_id(), file.face_index, glyph_index );
+			hit = cache->find( key );
+		}
+		slot = face->glyph;
+		if ( hit ) {
+			error = 0;
+			memset( &ftoutline, 0, sizeof( ftoutline ) );
+			gm = hit->metrics;
+			ir = hit->ir;
+			if ( hasDebug ) debug << "\nGlyph found in cache";
+		} else {
+			error = FT_Load_Glyph( face, glyph_index, FT_LOAD_NO_SCALE );
+			if ( hasDebug ) debug << "\nLoad Glyph into Face's glyph slot. error code: " << error;
+			ftoutline = slot->outline;
+			gm = slot->metrics;
+			ir.build( ftoutline );
+			ir.units_per_em = face->units_per_EM;
+			if ( cache && !error ) cache->insert( key, ir, gm );
+		}
+		char glyph_name[1024];
+		FT_Get_Glyph_Name( face, glyph_index, glyph_name, 1024 );
+		if ( hasDebug ) debug << "\nGlyph Name: " << glyph_name;
+		if ( hasDebug ) debug << "\nGlyph Width: " << gm.width
+			<< " Height: " << gm.height
+			<< " Hor. Advance: " << gm.horiAdvance
+			<< " Vert. Advance: " << gm.vertAdvance;
+
+		this->gWidth = gm.width;
+		this->gHeight = gm.height;
+		this->gWidth = gm.horiAdvance; //TEST
+		this->gHeight = gm.vertAdvance;
+
+		// Print outline details, taken from the glyph in the slot.
+		if ( hasDebug ) debug << "\nNum points: " << ftoutline.n_points;
+		if ( hasDebug ) debug << "\nNum contours: " << ftoutline.n_contours;
+		if ( hasDebug ) debug << "\nContour endpoint index values:";
+		if ( hasDebug ) 
+		  for ( int i = 0 ; i < ftoutline.n_contours ; i++ )
+		    debug << " " << ftoutline.contours[i];
+		if ( hasDebug ) debug << "\n-->\n";
+
+		// y coordinates are inverted (SVG = neg at top, TType = neg at
+		// bottom) by the emitters, the slot's outline is left untouched
+		ftpoints = ftoutline.points;
+
+		bbheight = face->bbox.yMax - face->bbox.yMin;
+		bbwidth = face->bbox.xMax - face->bbox.xMin;
+		tags = ftoutline.tags;
+		contours = ftoutline.contours;
+		if ( hasDebug ) std::cout << debug.str();
+	}
+
+	/* The pieces of the SVG document, appended to 'svg' (which may stream
+	to an output_sink) or, in the std::string forms, returned as text.
+	Like the outline they are scaled to emSize when it is set, so every
+	piece of the document is in the same units. */
+	void svgheader( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n<svg width='" );
+		put_units( svg, s, bbwidth );
+		svg.put( "px' height='" );
+		put_units( svg, s, bbheight );
+		svg.put( "px' xmlns='http://www.w3.org/2000/svg' version='1.1'>" );
+	}
+
+	void svgborder( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n\n <!-- draw border -->" );
+		svg.put( "\n <rect fill='none' stroke='black' width='" );
+		put_units( svg, s, bbwidth - 1 );
+		svg.put( "' height='" );
+		put_units( svg, s, bbheight - 1 );
+		svg.put( "'/>" );
+	}
+
+	void svgtransform( out_buffer &svg ) {
+		// TrueType points are not in the range usually visible by SVG.
+		// they often have negative numbers etc. So.. here we
+		// 'transform' to make visible.
+		//
+		// note also that y coords of all points are flipped by the
+		// emitters so that SVG Y positive = Truetype Y positive
+		double s = scale();
+		svg.put( "\n\n <!-- make sure glyph is visible within svg window -->" );
+		int yadj = gm.horiBearingY + gm.vertBearingY + 100;
+		int xadj = 100;
+		svg.put( "\n <g fill-rule='nonzero'  transform='translate(" );
+		put_units( svg, s, xadj );
+		svg.put( ' ' );
+		put_units( svg, s, yadj );
+		svg.put( ")'>" );
+	}
+
+	void axes( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n\n  <!-- draw axes --> " );
+		svg.put( "\n <path stroke='blue' stroke-dasharray='5,5' d=' M" );
+		xy( svg, s, -bbwidth, 0 );
+		svg.put( " L" );
+		xy( svg, s, bbwidth, 0 );
+		svg.put( " M" );
+		xy( svg, s, 0, -bbheight );
+		svg.put( " L" );
+		xy( svg, s, 0, bbheight );
+		svg.put( " '/>" );
+	}
+
+	void typography_box( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n\n  <!-- draw bearing + advance box --> " );
+		int x1 = 0;
+		int x2 = gm.horiAdvance;
+		int y1 = -gm.vertBearingY-gm.height;
+		int y2 = y1 + gm.vertAdvance;
+		svg.put( "\n <path stroke='blue' fill='none' stroke-dasharray='10,16' d=' M" );
+		xy( svg, s, x1, y1 );
+		svg.put( " M" );
+		xy( svg, s, x1, y2 );
+		svg.put( " L" );
+		xy( svg, s, x2, y2 );
+		svg.put( " L" );
+		xy( svg, s, x2, y1 );
+		svg.put( " L" );
+		xy( svg, s, x1, y1 );
+		svg.put( " '/>" );
+	}
+
+	void points( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n\n  <!-- draw points as circles -->" );
+		affine t = affine::svg();
+		int n_points = ir.px.size();
+		for ( int i = 0 ; i < n_points ; i++ ) {
+			bool this_is_ctrl_pt = !ir.on_curve[i];
+			bool next_is_ctrl_pt = !ir.on_curve[(i+1)%n_points];
+			long x = t.x(ir.px[i]);
+			long y = t.y(ir.py[i]);
+			long nx = t.x(ir.px[(i+1)%n_points]);
+			long ny = t.y(ir.py[(i+1)%n_points]);
+			int radius = 5;
+			if ( i == 0 ) radius = 10;
+			const char * color = this_is_ctrl_pt ? "none" : "blue";
+			if (this_is_ctrl_pt && next_is_ctrl_pt) {
+				svg.put( "\n  <!-- halfway pt between 2 ctrl pts -->" );
+				svg.put( "<circle fill='blue' stroke='black' cx='" );
+				put_units( svg, s, (x+nx)/2 );
+				svg.put( "' cy='" );
+				put_units( svg, s, (y+ny)/2 );
+				svg.put( "' r='" );
+				put_units( svg, s, 2 );
+				svg.put( "'/>" );
+			};
+			svg.put( "\n  <!--" );
+			svg.put_int( i );
+			svg.put( "--><circle fill='" );
+			svg.put( color );
+			svg.put( "' stroke='black' cx='" );
+			put_units( svg, s, x );
+			svg.put( "' cy='" );
+			put_units( svg, s, y );
+			svg.put( "' r='" );
+			put_units( svg, s, radius );
+			svg.put( "'/>" );
+		}
+	}
+
+	void pointlines( out_buffer &svg ) {
+		double s = scale();
+		svg.put( "\n\n  <!-- draw straight lines between points -->" );
+		affine t = affine::svg();
+		int n_points = ir.px.size();
+		if ( n_points == 0 ) return;
+		svg.put( "\n  <path fill='none' stroke='green' d='" );
+		svg.put( "\n   M " );
+		point( svg, s, t, 0 );
+		svg.put( "\n\n  '/>" );
+		for ( int i = 0 ; i < n_points-1 ; i++ ) {
+			const char * dash_mod = "";
+			for (size_t j = 0 ; j < ir.contour_ends.size(); j++ ) {
+				if (i==ir.contour_ends[j])
+					dash_mod = " stroke-dasharray='3'";
+			}
+			svg.put( "\n  <path fill='none' stroke='green'" );
+			svg.put( dash_mod );
+			svg.put( " d=' M " );
+			point( svg, s, t, i );
+			svg.put( " L " );
+			point( svg, s, t, (i+1)%n_points );
+			svg.put( "\n  '/>" );
+		}
+	}
+
+	void labelpts( out_buffer &svg ) {
+		double s = scale();
+		affine t = affine::svg();
+		for ( size_t i = 0 ; i < ir.px.size() ; i++ ) {
+			svg.put( "\n <g font-family='SVGFreeSansASCII,sans-serif' font-size='10'>\n" );
+			svg.put( "  <text id='revision' x='" );
+			put_coord( svg, s, t.x(ir.px[i]) + 5 );
+			svg.put( "' y='" );
+			put_coord( svg, s, t.y(ir.py[i]) - 5 );
+			svg.put( "' stroke='none' fill='darkgreen'>\n  " );
+			point( svg, s, t, i );
+			svg.put( "  </text>\n" );
+			svg.put( " </g>\n" );
+		}
+	}
+
+	void svgfooter( out_buffer &svg ) {
+		svg.put( "\n </g>\n</svg>\n" );
+	}
+
+	std::string svgheader() { out_buffer svg; svgheader( svg ); return svg.str(); }
+	std::string svgborder() { out_buffer svg; svgborder( svg ); return svg.str(); }
+	std::string svgtransform() { out_buffer svg; svgtransform( svg ); return svg.str(); }
+	std::string axes() { out_buffer svg; axes( svg ); return svg.str(); }
+	std::string typography_box() { out_buffer svg; typography_box( svg ); return svg.str(); }
+	std::string points() { out_buffer svg; points( svg ); return svg.str(); }
+	std::string pointlines() { out_buffer svg; pointlines( svg ); return svg.str(); }
+	std::string labelpts() { out_buffer svg; labelpts( svg ); return svg.str(); }
+	std::string svgfooter() { out_buffer svg; svgfooter( svg ); return svg.str(); }
+
+	std::string outline()  {
+		out_buffer svg;
+		outline( svg );
+		return svg.str();
+	}
+
+	/* The outline as polylines, see flatten_outline() */
+	void flatten( flat_outline &out )  {
+		outline_options o = options();
+		flatten_outline(ir, affine::svg(o.offsetX, o.offsetY, o.scale(ir.units_per_em)), o.scaled_tolerance(ir.units_per_em), out);
+	}
+
+	/* Append the outline to a reusable buffer */
+	void outline( out_buffer &svg )  {
+		do_outline(ir, options(), svg);
+	}
+
+	/* The same, through a disk_cache: the stored text if this font, glyph
+	and options were converted before, else converted and stored */
+	void outline( out_buffer &svg, disk_cache &cache )  {
+		outline_options o = options();
+		uint64_t font_hash = file.hash();
+		if ( !font_hash ) {
+			do_outline(ir, o, svg);
+			return;
+		}
+		cache_key key( font_hash, file.face_index, glyph_index, o );
+		if ( cache.lookup( key, svg ) ) return;
+		if ( svg.streaming() ) {
+			// the text must stay in one piece to be stored
+			out_buffer text;
+			do_outline(ir, o, text);
+			cache.store( key, text.data(), text.size() );
+			svg.put( text.data(), text.size() );
+			return;
+		}
+		size_t start = svg.size();
+		do_outline(ir, o, svg);
+		cache.store( key, svg.data() + start, svg.size() - start );
+	}
+
+	/* The glyph's emitter settings as one outline_options */
+	outline_options options() const {
+		outline_options o;
+		o.offsetX = offsetX;
+		o.offsetY = offsetY;
+		o.generateBezierStatements = generateBezierStatements;
+		o.tolerance = tolerance;
+		o.compact = compact;
+		o.coords = coords;
+		o.emSize = emSize;
+		o.precision = precision;
+		return o;
+	}
+
+private:
+	double scale() const {
+		return options().scale( ir.units_per_em );
+	}
+
+	// v in font units, written as is when nothing is scaled, else scaled
+	// and rounded to 'precision' decimals like the outline
+	void put_units( out_buffer &svg, double s, long v ) {
+		if ( s == 1.0 ) svg.put_int( v );
+		else put_scaled( svg, v * s );
+	}
+
+	// the same for a double, which operator<< writes when unscaled
+	void put_coord( out_buffer &svg, double s, double v ) {
+		if ( s == 1.0 ) svg.put_double( v );
+		else put_scaled( svg, v * s );
+	}
+
+	void put_scaled( out_buffer &svg, double v ) {
+		int decimals = options().decimals();
+		svg.put_fixed( toFixed( v, fixedUnit( decimals ) ), decimals );
+	}
+
+	void xy( out_buffer &svg, double s, long x, long y ) {
+		put_units( svg, s, x );
+		svg.put( ',' );
+		put_units( svg, s, y );
+	}
+
+	// point i as "x,y"
+	void point( out_buffer &svg, double s, const affine &t, size_t i ) {
+		put_coord( svg, s, t.x(ir.px[i]) );
+		svg.put( ',' );
+		put_coord( svg, s, t.y(ir.py[i]) );
+	}
+};
+
+/* Loads glyphs into a face's glyph slot and appends their outlines to an
+out_buffer through an outline_ir that is reused from glyph to glyph. Used
+by batch and parallel_export. */
+class glyph_converter
+{
+public:
+	glyph_converter() : cache( NULL ), glyphs( NULL ), font_hash( 0 ), face_id( 0 ), face_index( 0 ) {}
+
+	/* Look outlines up in 'cache' and decoded glyphs in 'glyphs' (NULL for
+	none) before loading them. The face that convert() is given is
+	face_index of the font with content hash font_hash, for 'cache', and
+	id face_id (ttf_file::face_id(), mapped_file::id()), for 'glyphs'; a
+	hash or id of 0 (unknown) disables that cache. */
+	void use_cache( disk_cache *cache, uint64_t font_hash, long face_index,
+		glyph_cache *glyphs = NULL, uint64_t face_id = 0 )
+	{
+		this->cache = font_hash ? cache : NULL;
+		this->glyphs = face_id ? glyphs : NULL;
+		this->font_hash = font_hash;
+		this->face_id = face_id;
+		this->face_index = face_index;
+	}
+
+	FT_Error convert( FT_Face face, FT_UInt glyph_index, const outline_options &options, out_buffer &out )
+	{
+		cache_key key;
+		if ( cache ) {
+			key = cache_key( font_hash, face_index, glyph_index, options );
+			if ( cache->lookup( key, out ) ) return 0;
+			if ( out.streaming() ) {
+				// converted apart, so the text stored is in one piece
+				text.clear();
+				FT_Error error = convert( face, glyph_index, options, text, key );
+				out.put( text.data(), text.size() );
+				return error;
+			}
+		}
+		return convert( face, glyph_index, options, out, key );
+	}
+
+	outline_ir ir;
+
+private:
+	disk_cache *cache;
+	glyph_cache *glyphs;
+	uint64_t font_hash;
+	uint64_t face_id;
+	long face_index;
+	out_buffer text;
+
+	FT_Error convert( FT_Face face, FT_UInt glyph_index, const outline_options &options, out_buffer &out, const cache_key &key )
+	{
+		size_t start = out.size();
+		std::shared_ptr<const cached_glyph> hit;
+		if ( glyphs ) hit = glyphs->find( cache_key( face_id, face_index, glyph_index ) );
+		if ( hit ) {
+			do_outline( hit->ir, options, out );
+		} else {
+			FT_Error error = FT_Load_Glyph( face, glyph_index, FT_LOAD_NO_SCALE );
+			if ( error ) return error;
+			ir.build( face->glyph->outline );
+			ir.units_per_em = face->units_per_EM;
+			if ( glyphs ) glyphs->insert( cache_key( face_id, face_index, glyph_index ), ir, face->glyph->metrics );
+			do_outline( ir, options, out );
+		}
+		if ( cache ) cache->store( key, out.data() + start, out.size() - start );
+		return 0;
+	}
+};
+
+/* Convert many glyphs of one face in a single pass.
+
+The face's glyph slot, the point/tag/contour arrays and the output buffer
+are reused from glyph to glyph, so the only per-glyph work is FT_Load_Glyph
+and the outline conversion itself. All outlines are stored back to back in
+'data'; outline i is data[offsets[i], offsets[i+1]).
+
+Glyphs are picked by codepoint, or directly by glyph index when
+'codepoints' is empty: then 'glyph_indices' is the input, and no cmap
+lookup is made (see glyphs_of() for every glyph of the face).
+
+run( out ) writes the outlines to another buffer instead, typically one
+streaming to an output_sink, so a large export goes straight to disk in
+bounded memory; 'offsets' are then positions in everything written, from
+where the run started. outline( i ) only reads 'data', so after such a run
+it returns an empty string.
+*/
+class batch
+{
+public:
+	ttf_file file;
+	std::vector<FT_ULong> codepoints;
+	std::vector<FT_UInt> glyph_indices;
+	std::vector<FT_Error> errors;
+
+	out_buffer data;
+	std::vector<size_t> offsets;
+
+	outline_options options;
+	disk_cache *cache;   // optional, see glyph_converter::use_cache()
+	glyph_cache *glyphs; // optional, likewise
+
+	batch( ttf_file &f, const std::vector<FT_ULong> &codepoints,
+		double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true,
+		double tolerance = defaultTolerance )
+		: cache( NULL ), glyphs( NULL ), in_data( false ), base( 0 )
+	{
+		file = f;
+		this->codepoints = codepoints;
+		options.offsetX = offsetX;
+		options.offsetY = offsetY;
+		options.generateBezierStatements = generateBezierStatements;
+		options.tolerance = tolerance;
+	}
+
+	batch( ttf_file &f, const std::vector<FT_ULong> &codepoints, const outline_options &options )
+		: cache( NULL ), glyphs( NULL ), in_data( false ), base( 0 )
+	{
+		file = f;
+		this->codepoints = codepoints;
+		this->options = options;
+	}
+
+	batch( ttf_file &f, const std::vector<FT_UInt> &glyph_indices,
+		const outline_options &options = outline_options() )
+		: cache( NULL ), glyphs( NULL ), in_data( false ), base( 0 )
+	{
+		file = f;
+		this->glyph_indices = glyph_indices;
+		this->options = options;
+	}
+
+	/* Every glyph index of the face, 0 .. num_glyphs-1 */
+	static std::vector<FT_UInt> glyphs_of( ttf_file &f )
+	{
+		std::vector<FT_UInt> res( f.face->num_glyphs );
+		for ( size_t i = 0 ; i < res.size() ; i++ ) res[i] = (FT_UInt)i;
+		return res;
+	}
+
+	/* Every codepoint mapped by the face's active charmap, in order. */
+	static std::vector<FT_ULong> cmap( ttf_file &f )
+	{
+		std::vector<FT_ULong> res;
+		face_lock guard = f.lock_face();
+		FT_UInt gindex;
+		FT_ULong charcode = FT_Get_First_Char( f.face, &gindex );
+		while ( gindex != 0 ) {
+			res.push_back( charcode );
+			charcode = FT_Get_Next_Char( f.face, charcode, &gindex );
+		}
+		return res;
+	}
+
+	/* The codepoints in [first, last] that the face actually maps. */
+	static std::vector<FT_ULong> range( ttf_file &f, FT_ULong first, FT_ULong last )
+	{
+		std::vector<FT_ULong> res;
+		face_lock guard = f.lock_face();
+		FT_UInt gindex;
+		FT_ULong charcode = FT_Get_Next_Char( f.face, first > 0 ? first - 1 : 0, &gindex );
+		if ( first == 0 && FT_Get_Char_Index( f.face, 0 ) != 0 ) res.push_back( 0 );
+		while ( gindex != 0 && charcode <= last ) {
+			if ( charcode >= first ) res.push_back( charcode );
+			charcode = FT_Get_Next_Char( f.face, charcode, &gindex );
+		}
+		return res;
+	}
+
+	void run()
+	{
+		data.clear();
+		run( data );
+	}
+
+	void run( out_buffer &out )
+	{
+		offsets.clear();
+		if ( !codepoints.empty() ) {
+			face_lock guard = file.lock_face();
+			glyph_indices.resize( codepoints.size() );
+			for ( size_t i = 0 ; i < codepoints.size() ; i++ )
+				glyph_indices[i] = FT_Get_Char_Index( file.face, codepoints[i] );
+		}
+		errors.resize( glyph_indices.size() );
+		offsets.reserve( glyph_indices.size() + 1 );
+		offsets.push_back( 0 );
+		converter.use_cache( cache, cache ? file.hash() : 0, file.face_index, glyphs, file.face_id() );
+		size_t start = out.position();
+		in_data = &out == &data;
+		base = start;
+		for ( size_t i = 0 ; i < glyph_indices.size() ; i++ ) {
+			face_lock guard = file.lock_face();
+			errors[i] = converter.convert( file.face, glyph_indices[i], options, out );
+			offsets.push_back( out.position() - start );
+		}
+	}
+
+	size_t size() const
+	{
+		return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+
+	/* Outline i of the last run, if that run went to 'data' */
+	std::string outline( size_t i ) const
+	{
+		if ( !in_data || i >= size() ) return std::string();
+		return std::string( data.data() + base + offsets[i], offsets[i+1] - offsets[i] );
+	}
+
+	void free()
+	{
+		file.free();
+	}
+
+private:
+	glyph_converter converter;
+	bool in_data; // the last run wrote to 'data'
+	size_t base;  // where in it
+};
+
+/* Convert many glyphs of one font on several threads.
+
+FreeType faces are not thread safe, so every worker opens its own
+FT_Library and FT_Face over one shared read-only mapping of the font file
+(or the buffer of a ttf_file that has the file open).
+Glyphs are picked by codepoint or, when 'codepoints' is empty, by the
+indices in 'glyph_indices'. They are cut into chunks that are dealt out
+evenly to the workers; a worker that runs out of chunks steals from the back of another
+worker's queue. Each glyph's outline is written to its own slot in
+'outlines', so workers never share output.
+*/
+class parallel_export
+{
+public:
+	std::string filename;
+	long face_index;
+	std::vector<FT_ULong> codepoints;
+	std::vector<FT_UInt> glyph_indices;
+	std::vector<std::string> outlines;
+	std::vector<FT_Error> errors;
+
+	outline_options options;
+	disk_cache *cache;   // optional, shared by the workers
+	glyph_cache *glyphs; // optional, likewise
+	unsigned int threads;
+	size_t chunk_size;
+
+	/* Export every codepoint in the font's charmap */
+	parallel_export( std::string fname, unsigned int threads = 0, long face_index = 0 )
+	{
+		ttf_file f( fname, face_index );
+		setup( fname, batch::cmap( f ), threads, face_index );
+		f.free();
+	}
+
+	parallel_export( std::string fname, const std::vector<FT_ULong> &codepoints,
+		unsigned int threads = 0, long face_index = 0 )
+	{
+		setup( fname, codepoints, threads, face_index );
+	}
+
+	parallel_export( std::string fname, const std::vector<FT_UInt> &glyph_indices,
+		unsigned int threads = 0, long face_index = 0 )
+	{
+		setup( fname, std::vector<FT_ULong>(), threads, face_index );
+		this->glyph_indices = glyph_indices;
+	}
+
+	/* Number of glyphs to export */
+	size_t count() const
+	{
+		return codepoints.empty() ? glyph_indices.size() : codepoints.size();
+	}
+
+	/* Returns false if the font could not be read or a worker could not
+	open its face. Per-glyph load errors are in 'errors'. */
+	bool run()
+	{
+		outlines.assign( count(), std::string() );
+		errors.assign( count(), 0 );
+		fontdata = face_registry::instance().mapping( filename );
+		if ( !fontdata ) {
+			std::cerr << "problem loading file " << filename << "\n";
+			return false;
+		}
+		font_hash = 0;
+		if ( cache ) {
+			font_hash = fnv1a( fontdata->data(), fontdata->size() );
+			if ( !font_hash ) font_hash = 1;
+		}
+
+		size_t nchunks = ( count() + chunk_size - 1 ) / chunk_size;
+		unsigned int nthreads = threads;
+		if ( nthreads == 0 ) nthreads = std::thread::hardware_concurrency();
+		if ( nthreads == 0 ) nthreads = 1;
+		if ( nthreads > nchunks ) nthreads = nchunks > 0 ? nchunks : 1;
+
+		queues = std::vector<chunk_queue>( nthreads );
+		for ( unsigned int w = 0 ; w < nthreads ; w++ )
+			for ( size_t c = w * nchunks / nthreads ; c < ( w + 1 ) * nchunks / nthreads ; c++ )
+				queues[w].chunks.push_back( c );
+
+		failed = false;
+		std::vector<std::thread> pool;
+		for ( unsigned int w = 1 ; w < nthreads ; w++ )
+			pool.push_back( std::thread( &parallel_export::work, this, w ) );
+		work( 0 );
+		for ( size_t w = 0 ; w < pool.size() ; w++ ) pool[w].join();
+		queues.clear();
+		fontdata.reset();
+		return !failed;
+	}
+
+private:
+	struct chunk_queue
+	{
+		std::mutex lock;
+		std::deque<size_t> chunks;
+		chunk_queue() {}
+		chunk_queue( const chunk_queue & ) {}
+	};
+
+	std::shared_ptr<mapped_file> fontdata;
+	uint64_t font_hash;
+	std::vector<chunk_queue> queues;
+	std::atomic<bool> failed;
+
+	void setup( std::string fname, const std::vector<FT_ULong> &codepoints,
+		unsigned int threads, long face_index )
+	{
+		filename = fname;
+		this->face_index = face_index;
+		this->codepoints = codepoints;
+		this->threads = threads;
+		cache = NULL;
+		glyphs = NULL;
+		font_hash = 0;
+		chunk_size = 64;
+	}
+
+	bool next_chunk( unsigned int w, size_t &chunk )
+	{
+		{
+			std::lock_guard<std::mutex> guard( queues[w].lock );
+			if ( !queues[w].chunks.empty() ) {
+				chunk = queues[w].chunks.front();
+				queues[w].chunks.pop_front();
+				return true;
+			}
+		}
+		for ( size_t k = 1 ; k < queues.size() ; k++ ) {
+			chunk_queue &victim = queues[( w + k ) % queues.size()];
+			std::lock_guard<std::mutex> guard( victim.lock );
+			if ( !victim.chunks.empty() ) {
+				chunk = victim.chunks.back();
+				victim.chunks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work( unsigned int w )
+	{
+		FT_Library library;
+		FT_Face face;
+		if ( FT_Init_FreeType( &library ) ) {
+			failed = true;
+			return;
+		}
+		if ( FT_New_Memory_Face( library, fontdata->data(), fontdata->size(), face_index, &face ) ) {
+			FT_Done_FreeType( library );
+			failed = true;
+			return;
+		}
+		glyph_converter converter;
+		converter.use_cache( cache, font_hash, face_index, glyphs, fontdata->id() );
+		out_buffer svg;
+		size_t chunk;
+		while ( !failed && next_chunk( w, chunk ) ) {
+			size_t end = std::min( ( chunk + 1 ) * chunk_size, count() );
+			for ( size_t i = chunk * chunk_size ; i < end ; i++ ) {
+				FT_UInt glyph_index = codepoints.empty() ? glyph_indices[i]
+					: FT_Get_Char_Index( face, codepoints[i] );
+				svg.clear();
+				errors[i] = converter.convert( face, glyph_index, options, svg );
+				outlines[i].assign( svg.data(), svg.size() );
+			}
+		}
+		FT_Done_Face( face );
+		FT_Done_FreeType( library );
+	}
+};
+
+/* Append the codepoints of the UTF-8 text s[0..n) to 'out'. Malformed,
+overlong and surrogate sequences each become U+FFFD. */
+inline void utf8_decode( const char * s, size_t n, std::vector<FT_ULong> &out )
+{
+	const unsigned char * p = reinterpret_cast<const unsigned char *>( s );
+	const unsigned char * end = p + n;
+	while ( p < end ) {
+		unsigned char c = *p++;
+		if ( c < 0x80 ) {
+			out.push_back( c );
+			continue;
+		}
+		int extra;
+		FT_ULong cp, min;
+		if ( c >= 0xc2 && c <= 0xdf ) { extra = 1; cp = c & 0x1f; min = 0x80; }
+		else if ( c >= 0xe0 && c <= 0xef ) { extra = 2; cp = c & 0x0f; min = 0x800; }
+		else if ( c >= 0xf0 && c <= 0xf4 ) { extra = 3; cp = c & 0x07; min = 0x10000; }
+		else { out.push_back( 0xfffd ); continue; }
+		int i = 0;
+		while ( i < extra && p < end && ( *p & 0xc0 ) == 0x80 ) {
+			cp = ( cp << 6 ) | ( *p++ & 0x3f );
+			i++;
+		}
+		if ( i < extra || cp < min || cp > 0x10ffff || ( cp >= 0xd800 && cp <= 0xdfff ) )
+			out.push_back( 0xfffd );
+		else
+			out.push_back( cp );
+	}
+}
+
+/* Codepoint to glyph index lookups for one face. Results for the Basic
+Multilingual Plane are kept in a flat table filled as codepoints are
+first seen, so text mostly costs one array read per character; other
+planes go to FreeType every time. The table is 256 KB, so use shared()
+to get the one kept with the open face rather than one per text. */
+class char_map
+{
+public:
+	char_map() : face( NULL ), lock( NULL ) {}
+
+	/* 'lock', if not NULL, is held around every lookup */
+	char_map( FT_Face face, std::recursive_mutex * lock = NULL )
+		: face( face ), lock( lock ), bmp( 0x10000, unknown ) {}
+
+	/* The face's char_map, shared by every user of f's face under the
+	face's lock */
+	static std::shared_ptr<char_map> shared( ttf_file &f )
+	{
+		if ( !f.entry ) return std::make_shared<char_map>( f.face );
+		return face_registry::instance().attach( f.entry, &face_entry::cmap );
+	}
+
+	FT_UInt operator()( FT_ULong codepoint )
+	{
+		face_lock guard = locked();
+		return find( codepoint );
+	}
+
+	/* Glyph indices for a whole run of codepoints, under one lock */
+	void lookup( const FT_ULong * codepoints, size_t n, FT_UInt * glyph_indices )
+	{
+		face_lock guard = locked();
+		for ( size_t i = 0 ; i < n ; i++ ) glyph_indices[i] = find( codepoints[i] );
+	}
+
+private:
+	enum { unknown = ~0U }; // not looked up yet
+	FT_Face face;
+	std::recursive_mutex * lock;
+
+	face_lock locked() { return lock ? face_lock( *lock ) : face_lock(); }
+
+	FT_UInt find( FT_ULong codepoint )
+	{
+		if ( codepoint >= 0x10000 ) return FT_Get_Char_Index( face, codepoint );
+		FT_UInt &g = bmp[codepoint];
+		if ( g == unknown ) g = FT_Get_Char_Index( face, codepoint );
+		return g;
+	}
+
+	std::vector<FT_UInt> bmp;
+};
+
+/* Pair kerning for one face from its 'kern' table, in font units.
+FreeType can not enumerate the pairs, so each one is looked up with
+FT_Get_Kerning the first time it is asked for and kept in a hash table;
+faces without a 'kern' table answer 0 without hashing. GPOS pair
+adjustments are not read by FreeType. Use shared() so pairs looked up once serve every text. */
+class kerning_table
+{
+public:
+	kerning_table() : face( NULL ), lock( NULL ), has_kerning( false ) {}
+
+	/* 'lock', if not NULL, is held around every lookup */
+	kerning_table( FT_Face face, std::recursive_mutex * lock = NULL )
+		: face( face ), lock( lock ), has_kerning( FT_HAS_KERNING( face ) != 0 ) {}
+
+	/* The face's kerning_table, shared like char_map::shared() */
+	static std::shared_ptr<kerning_table> shared( ttf_file &f )
+	{
+		if ( !f.entry ) return std::make_shared<kerning_table>( f.face );
+		return face_registry::instance().attach( f.entry, &face_entry::kern );
+	}
+
+	FT_Pos operator()( FT_UInt left, FT_UInt right )
+	{
+		if ( !has_kerning || !left || !right ) return 0;
+		face_lock guard = lock ? face_lock( *lock ) : face_lock();
+		uint64_t key = ( (uint64_t)left << 32 ) | right;
+		std::unordered_map<uint64_t, FT_Pos>::iterator it = pairs.find( key );
+		if ( it != pairs.end() ) return it->second;
+		FT_Vector k;
+		if ( FT_Get_Kerning( face, left, right, FT_KERNING_UNSCALED, &k ) ) k.x = 0;
+		pairs[key] = k.x;
+		return k.x;
+	}
+
+private:
+	FT_Face face;
+	std::recursive_mutex * lock;
+	bool has_kerning;
+	std::unordered_map<uint64_t, FT_Pos> pairs;
+};
+
+/* Text drawn as one SVG document, each distinct glyph stored once.
+
+Every glyph is converted the first time it is added, into a <defs> path
+with its origin on the baseline, and each occurrence is a <use> at the pen
+position. The pen starts at (options.offsetX, options.offsetY) and moves
+right by the glyph's horizontal advance (horiAdvance) plus the face's
+kerning for the pair with the previous glyph; '\n' moves it to the start of
+the next line, one face height down. Positions and the viewBox are in
+output units, so options.emSize scales the whole run. Text is added as
+codepoints or UTF-8, or as glyph indices.
+*/
+class text_run
+{
+public:
+	ttf_file file;
+	outline_options options;
+	glyph_cache *glyphs;    // optional, shared with other runs or threads
+	std::string id_prefix;  // <defs> ids are id_prefix + glyph index
+	FT_Error error;         // last glyph load error, 0 if none
+	bool kerning;           // apply 'kern' table pairs, on by default
+	double pen_x, pen_y;
+
+	text_run( ttf_file &f, const outline_options &options = outline_options() )
+		: glyphs( NULL ), id_prefix( "g" ), error( 0 ), kerning( true ),
+		  previous( 0 ), cmap( char_map::shared( f ) ), kern( kerning_table::shared( f ) )
+	{
+		file = f;
+		this->options = options;
+		clear();
+	}
+
+	/* Forget the text; the pen goes back to the offsets */
+	void clear()
+	{
+		def_index.clear();
+		defs.clear();
+		placements.clear();
+		def_data.clear();
+		pen_x = max_x = options.offsetX;
+		pen_y = options.offsetY;
+		lines = 1;
+		previous = 0;
+	}
+
+	void add( FT_ULong codepoint )
+	{
+		if ( codepoint == '\n' ) {
+			newline();
+			return;
+		}
+		add_glyph( (*cmap)( codepoint ) );
+	}
+
+	void add( const std::vector<FT_ULong> &codepoints )
+	{
+		if ( codepoints.empty() ) return;
+		indices.resize( codepoints.size() );
+		cmap->lookup( &codepoints[0], codepoints.size(), &indices[0] );
+		for ( size_t i = 0 ; i < codepoints.size() ; i++ ) {
+			if ( codepoints[i] == '\n' ) newline();
+			else add_glyph( indices[i] );
+		}
 	}
 
-  glyph( const char * filename, const char * unicode_c_str, double offsetX, double offsetY, bool generateBezierStatements )
+	void add_utf8( const char * text, size_t n )
 	{
-		this->file = ttf_file( std::string(filename) );
-		init( std::string(unicode_c_str), offsetX, offsetY, generateBezierStatements );
+		decoded.clear();
+		utf8_decode( text, n, decoded );
+		add( decoded );
+	}
+
+	void add_utf8( const std::string &text )
+	{
+		add_utf8( text.data(), text.size() );
+	}
+
+	void add_glyph( FT_UInt glyph_index )
+	{
+		if ( kerning ) pen_x += (*kern)( previous, glyph_index ) * scale();
+		previous = glyph_index;
+		size_t d = place( glyph_index, pen_x, pen_y );
+		pen_x += defs[d].advance * scale();
+		if ( pen_x > max_x ) max_x = pen_x;
+	}
+
+	void newline()
+	{
+		pen_x = options.offsetX;
+		pen_y += file.face->height * scale();
+		lines++;
+		previous = 0;
+	}
+
+	/* Number of drawn glyphs, and of distinct ones */
+	size_t size() const { return placements.size(); }
+	size_t distinct() const { return defs.size(); }
+
+	void svg( out_buffer &out ) const
+	{
+		FT_Face face = file.face;
+		double s = scale();
+		int decimals = options.decimals();
+		long unit = fixedUnit( decimals );
+		out.put( "<svg xmlns='http://www.w3.org/2000/svg' xmlns:xlink='http://www.w3.org/1999/xlink' version='1.1' viewBox='" );
+		out.put_fixed( toFixed( options.offsetX, unit ), decimals );
+		out.put( ' ' );
+		out.put_fixed( toFixed( options.offsetY - face->ascender * s, unit ), decimals );
+		out.put( ' ' );
+		out.put_fixed( toFixed( max_x - options.offsetX, unit ), decimals );
+		out.put( ' ' );
+		out.put_fixed( toFixed( ( ( lines - 1 ) * face->height + face->ascender - face->descender ) * s, unit ), decimals );
+		out.put( "'>\n<defs>\n" );
+		for ( size_t d = 0 ; d < defs.size() ; d++ ) {
+			if ( defs[d].end == defs[d].begin ) continue;
+			out.put( "<path id='" );
+			out.put( id_prefix );
+			out.put_int( defs[d].glyph_index );
+			out.put( "' d='" );
+			out.put( def_data.data() + defs[d].begin, defs[d].end - defs[d].begin );
+			out.put( "'/>\n" );
+		}
+		out.put( "</defs>\n<g fill='black' stroke='black' fill-opacity='0.45' stroke-width='2'>\n" );
+		for ( size_t i = 0 ; i < placements.size() ; i++ ) {
+			const placement &p = placements[i];
+			out.put( "<use xlink:href='#" );
+			out.put( id_prefix );
+			out.put_int( defs[p.def].glyph_index );
+			out.put( "' x='" );
+			out.put_fixed( toFixed( p.x, unit ), decimals );
+			out.put( "' y='" );
+			out.put_fixed( toFixed( p.y, unit ), decimals );
+			out.put( "'/>\n" );
+		}
+		out.put( "</g>\n</svg>\n" );
+	}
+
+	std::string svg() const
+	{
+		out_buffer out;
+		svg( out );
+		return out.str();
 	}
 
-  
 	void free()
 	{
 		file.free();
 	}
 
-  void init( std::string unicode_s, double offsetX = 0.0, double offsetY = 0.0, bool generateBezierStatements = true)
+private:
+	struct glyph_def
 	{
-	  this->offsetX = offsetX;
-	  this->offsetY = offsetY;
-	  this->generateBezierStatements = generateBezierStatements;
-	  
-		face = file.face;
-		codepoint = strtol( unicode_s.c_str() , NULL, 0 );
-		// Load the Glyph into the face's Glyph Slot + print details
-		FT_UInt glyph_index = FT_Get_Char_Index( face, codepoint );
-		if ( hasDebug ) debug << "<!--\nUnicode requested: " << unicode_s;
-		if ( hasDebug ) debug << " (decimal: " << codepoint << " hex: 0x"
-			<< std::hex << codepoint << std::dec << ")";
-		if ( hasDebug ) debug << "\nGlyph index for unicode: " << glyph_index;
-		error = FT_Load_Glyph( face, glyph_index, FT_LOAD_NO_SCALE );
-		if ( hasDebug ) debug << "\nLoad Glyph into Face's glyph slot. error code: " << error;
-		slot = face->glyph;
-		ftoutline = slot->outline;
-		char glyph_name[1024];
-		FT_Get_Glyph_Name( face, glyph_index, glyph_name, 1024 );
-		gm = slot->metrics;
-		if ( hasDebug ) debug << "\nGlyph Name: " << glyph_name;
-		if ( hasDebug ) debug << "\nGlyph Width: " << gm.width
-			<< " Height: " << gm.height
-			<< " Hor. Advance: " << gm.horiAdvance
-			<< " Vert. Advance: " << gm.vertAdvance;
+		FT_UInt glyph_index;
+		double advance;      // font units
+		size_t begin, end;   // path data in def_data, empty for blank glyphs
+	};
 
-		this->gWidth = gm.width;
-		this->gHeight = gm.height;
-		this->gWidth = gm.horiAdvance; //TEST
-		this->gHeight = gm.vertAdvance;
+	struct placement
+	{
+		size_t def;
+		double x, y;
+	};
 
-		// Print outline details, taken from the glyph in the slot.
-		if ( hasDebug ) debug << "\nNum points: " << ftoutline.n_points;
-		if ( hasDebug ) debug << "\nNum contours: " << ftoutline.n_contours;
-		if ( hasDebug ) debug << "\nContour endpoint index values:";
-		if ( hasDebug ) 
-		  for ( int i = 0 ; i < ftoutline.n_contours ; i++ )
-		    debug << " " << ftoutline.contours[i];
-		if ( hasDebug ) debug << "\n-->\n";
+	std::map<FT_UInt, size_t> def_index;
+	std::vector<glyph_def> defs;
+	std::vector<placement> placements;
+	out_buffer def_data;
+	double max_x;
+	int lines;
+	FT_UInt previous; // glyph before the pen, 0 at the start of a line
+	outline_ir ir;
+	std::shared_ptr<char_map> cmap; // the face's, see char_map::shared()
+	std::shared_ptr<kerning_table> kern; // the face's as well
+	std::vector<FT_ULong> decoded;  // scratch for add_utf8()
+	std::vector<FT_UInt> indices;   // scratch for add()
 
-		// Invert y coordinates (SVG = neg at top, TType = neg at bottom)
-		ftpoints = ftoutline.points;
-		for ( int i = 0 ; i < ftoutline.n_points ; i++ )
-			ftpoints[i].y *= -1;
+	double scale() const
+	{
+		return options.scale( file.face->units_per_EM );
+	}
 
-		bbheight = face->bbox.yMax - face->bbox.yMin;
-		bbwidth = face->bbox.xMax - face->bbox.xMin;
-		tags = ftoutline.tags;
-		contours = ftoutline.contours;
-		if ( hasDebug ) std::cout << debug.str();
+	// Draw 'glyph_index' at (x, y) unless it is blank; returns its def
+	size_t place( FT_UInt glyph_index, double x, double y )
+	{
+		size_t d = define( glyph_index );
+		if ( defs[d].end > defs[d].begin ) {
+			placement p;
+			p.def = d;
+			p.x = x;
+			p.y = y;
+			placements.push_back( p );
+		}
+		return d;
 	}
 
-	std::string svgheader() {
-		tmp.str("");
+	// Index of the def for 'glyph_index', converting the glyph if it is new
+	size_t define( FT_UInt glyph_index )
+	{
+		std::map<FT_UInt, size_t>::iterator it = def_index.find( glyph_index );
+		if ( it != def_index.end() ) return it->second;
+
+		glyph_def def;
+		def.glyph_index = glyph_index;
+		def.advance = 0;
+		const outline_ir *outline = &ir;
+		std::shared_ptr<const cached_glyph> hit;
+		glyph_cache *cache = file.face_id() ? glyphs : NULL;
+		cache_key key;
+		if ( cache ) {
+			key = cache_key( file.face_id(), file.face_index, glyph_index );
+			hit = cache->find( key );
+		}
+		if ( hit ) {
+			outline = &hit->ir;
+			def.advance = hit->metrics.horiAdvance;
+		} else {
+			face_lock guard = file.lock_face();
+			FT_Error e = FT_Load_Glyph( file.face, glyph_index, FT_LOAD_NO_SCALE );
+			if ( e ) {
+				error = e;
+				ir.clear();
+			} else {
+				ir.build( file.face->glyph->outline );
+				ir.units_per_em = file.face->units_per_EM;
+				def.advance = file.face->glyph->metrics.horiAdvance;
+				if ( cache ) cache->insert( key, ir, file.face->glyph->metrics );
+			}
+		}
 
-		tmp << "\n<svg width='" << bbwidth << "px'"
-			<< " height='" << bbheight << "px'"
-			<< " xmlns='http://www.w3.org/2000/svg' version='1.1'>";
+		// drawn at the origin, <use> moves it into place
+		outline_options at_origin = options;
+		at_origin.offsetX = 0;
+		at_origin.offsetY = 0;
+		def.begin = def_data.size();
+		if ( !outline->empty() ) do_path_data( *outline, at_origin, def_data );
+		def.end = def_data.size();
 
-		return tmp.str();
+		def_index[glyph_index] = defs.size();
+		defs.push_back( def );
+		return defs.size() - 1;
 	}
+};
 
-	std::string svgborder()  {
-		tmp.str("");
-		tmp << "\n\n <!-- draw border -->";
+/* How sprite_writer lays out a face */
+enum sprite_format {
+	sprite_symbols,  // one <symbol> per glyph, for <use xlink:href='#u0042'>
+	sprite_svg_font  // an SVG 1.1 <font>, one <glyph> per character
+};
+
+/* Stream the glyphs of one face into a single SVG document.
+
+With sprite_symbols every glyph is a <symbol> drawn at the origin on the
+baseline, its viewBox spanning the advance (or the ink, when that is wider)
+and the face's ascender to descender. With sprite_svg_font the glyphs go
+into a <font> with y upwards, as that format has it, and glyph 0 is the
+<missing-glyph>. Symbol ids and glyph-names are id_prefix + "u" + the
+codepoint in hex for characters, id_prefix + "g" + the glyph index for
+glyphs added by index.
+
+Glyphs are converted one at a time straight into a fixed-size out_buffer
+in front of the output_sink (or stream), which drains whenever it fills,
+so memory use does not grow with the number of glyphs. end() flushes.
+*/
+class sprite_writer
+{
+public:
+	ttf_file file;
+	outline_options options; // offsets are ignored, glyphs sit at the origin
+	sprite_format format;
+	std::string id_prefix;
+	glyph_cache *glyphs;     // optional
+	FT_Error error;          // last glyph load error, 0 if none
+	size_t written;          // glyphs written since begin()
 
-		tmp << "\n <rect fill='none' stroke='black'"
-			<< " width='" << bbwidth - 1 << "'"
-			<< " height='" << bbheight - 1 << "'/>";
-		return tmp.str();
+	sprite_writer( ttf_file &f, output_sink &out, sprite_format format = sprite_symbols,
+		const outline_options &options = outline_options() )
+		: format( format ), glyphs( NULL ), error( 0 ), written( 0 ), buf( out )
+	{
+		init( f, options );
 	}
 
-	std::string svgtransform() {
-		// TrueType points are not in the range usually visible by SVG.
-		// they often have negative numbers etc. So.. here we
-		// 'transform' to make visible.
-		//
-		// note also that y coords of all points have been flipped during
-		// init() so that SVG Y positive = Truetype Y positive
-		tmp.str("");
-		tmp << "\n\n <!-- make sure glyph is visible within svg window -->";
-		int yadj = gm.horiBearingY + gm.vertBearingY + 100;
-		int xadj = 100;
-		tmp << "\n <g fill-rule='nonzero' "
-			<< " transform='translate(" << xadj << " " << yadj << ")'"
-			<< ">";
-		return tmp.str();
-	}
-
-	std::string axes()  {
-		tmp.str("");
-		tmp << "\n\n  <!-- draw axes --> ";
-		tmp << "\n <path stroke='blue' stroke-dasharray='5,5' d='"
-			<< " M" << -bbwidth << "," << 0
-			<< " L" <<  bbwidth << "," << 0
-			<< " M" << 0 << "," << -bbheight
-			<< " L" << 0 << "," << bbheight
-			<< " '/>";
-		return tmp.str();
-	}
-
-	std::string typography_box()  {
-		tmp.str("");
-		tmp << "\n\n  <!-- draw bearing + advance box --> ";
-		int x1 = 0;
-		int x2 = gm.horiAdvance;
-		int y1 = -gm.vertBearingY-gm.height;
-		int y2 = y1 + gm.vertAdvance;
-		tmp << "\n <path stroke='blue' fill='none' stroke-dasharray='10,16' d='"
-			<< " M" << x1 << "," << y1
-			<< " M" << x1 << "," << y2
-			<< " L" << x2 << "," << y2
-			<< " L" << x2 << "," << y1
-			<< " L" << x1 << "," << y1
-			<< " '/>";
-
-		return tmp.str();
-	}
-
-	std::string points()  {
-		tmp.str("");
-		tmp << "\n\n  <!-- draw points as circles -->";
-		for ( int i = 0 ; i < ftoutline.n_points ; i++ ) {
-			bool this_is_ctrl_pt = !(tags[i] & 1);
-			bool next_is_ctrl_pt = !(tags[(i+1)%ftoutline.n_points] & 1);
-			int x = ftpoints[i].x;
-			int y = ftpoints[i].y;
-			int nx = ftpoints[(i+1)%ftoutline.n_points].x;
-			int ny = ftpoints[(i+1)%ftoutline.n_points].y;
-			int radius = 5;
-			if ( i == 0 ) radius = 10;
-			std::string color;
-			if (this_is_ctrl_pt) color = "none"; else color = "blue";
-			if (this_is_ctrl_pt && next_is_ctrl_pt) {
-				tmp << "\n  <!-- halfway pt between 2 ctrl pts -->";
-				tmp << "<circle"
-				  << " fill='" << "blue" << "'"
-				  << " stroke='black'"
-				  << " cx='" << (x+nx)/2 << "' cy='" << (y+ny)/2 << "'"
-				  << " r='" << 2 << "'"
-				  << "/>";
-			};
-			tmp << "\n  <!--" << i << "-->";
-			tmp << "<circle"
-				<< " fill='" << color << "'"
-				<< " stroke='black'"
-				<< " cx='" << ftpoints[i].x << "' cy='" << ftpoints[i].y << "'"
-				<< " r='" << radius << "'"
-				<< "/>";
-		}
-
-		return tmp.str();
-	}
-
-	std::string pointlines()  {
-		tmp.str("");
-		tmp << "\n\n  <!-- draw straight lines between points -->";
-		tmp << "\n  <path fill='none' stroke='green' d='";
-		tmp << "\n   M " << ftpoints[0].x << "," << ftpoints[0].y << "\n";
-		tmp << "\n  '/>";
-		for ( int i = 0 ; i < ftoutline.n_points-1 ; i++ ) {
-			std::string dash_mod("");
-			for (int j = 0 ; j < ftoutline.n_contours; j++ ) {
-				if (i==contours[j])
-					dash_mod = " stroke-dasharray='3'";
+	sprite_writer( ttf_file &f, std::ostream &out, sprite_format format = sprite_symbols,
+		const outline_options &options = outline_options() )
+		: format( format ), glyphs( NULL ), error( 0 ), written( 0 ),
+		  stream( new ostream_sink( out ) ), buf( *stream )
+	{
+		init( f, options );
+	}
+
+	/* The document header; for an SVG font also <font-face> and <missing-glyph> */
+	void begin()
+	{
+		FT_Face face = file.face;
+		written = 0;
+		buf.put( "<svg xmlns='http://www.w3.org/2000/svg' version='1.1'>\n" );
+		if ( format == sprite_svg_font ) {
+			buf.put( "<defs>\n<font id='" );
+			buf.put( id_prefix );
+			buf.put( "font' horiz-adv-x='" );
+			put_units( face->max_advance_width );
+			buf.put( "'>\n<font-face font-family='" );
+			put_xml( face->family_name ? face->family_name : "font2svg" );
+			buf.put( "' units-per-em='" );
+			put_units( face->units_per_EM );
+			buf.put( "' ascent='" );
+			put_units( face->ascender );
+			buf.put( "' descent='" );
+			put_units( face->descender );
+			buf.put( "'/>\n" );
+			const outline_ir &outline = load( 0 );
+			buf.put( "<missing-glyph horiz-adv-x='" );
+			put_units( metrics.horiAdvance );
+			put_path( outline );
+			buf.put( "/>\n" );
+		}
+	}
+
+	/* One character; false if the face has no glyph for it */
+	bool add( FT_ULong codepoint )
+	{
+		FT_UInt glyph_index;
+		{
+			face_lock guard = file.lock_face();
+			glyph_index = FT_Get_Char_Index( file.face, codepoint );
+		}
+		if ( !glyph_index ) return false;
+		write( glyph_index, codepoint, true );
+		return true;
+	}
+
+	/* One glyph by index, with no character */
+	void add_glyph( FT_UInt glyph_index )
+	{
+		write( glyph_index, 0, false );
+	}
+
+	void end()
+	{
+		if ( format == sprite_svg_font ) buf.put( "</font>\n</defs>\n" );
+		buf.put( "</svg>\n" );
+		buf.flush();
+	}
+
+	/* The whole face: every character of the charmap and, with all_glyphs,
+	the glyphs no character maps to (ligatures, alternates) by index */
+	void run( bool all_glyphs = false )
+	{
+		FT_Face face = file.face;
+		std::vector<bool> reached;
+		if ( all_glyphs ) reached.assign( face->num_glyphs, false );
+		begin();
+		if ( format == sprite_svg_font && all_glyphs && !reached.empty() ) reached[0] = true;
+		FT_UInt glyph_index;
+		FT_ULong codepoint;
+		{
+			face_lock guard = file.lock_face();
+			codepoint = FT_Get_First_Char( face, &glyph_index );
+		}
+		while ( glyph_index != 0 ) {
+			write( glyph_index, codepoint, true );
+			if ( glyph_index < reached.size() ) reached[glyph_index] = true;
+			face_lock guard = file.lock_face();
+			codepoint = FT_Get_Next_Char( face, codepoint, &glyph_index );
+		}
+		for ( size_t g = 0 ; g < reached.size() ; g++ )
+			if ( !reached[g] ) add_glyph( (FT_UInt)g );
+		end();
+	}
+
+private:
+	std::unique_ptr<ostream_sink> stream;
+	out_buffer buf;
+	outline_ir ir;
+	FT_Glyph_Metrics metrics;
+	std::shared_ptr<const cached_glyph> hit;
+
+	// Decode 'glyph_index' and its metrics; an empty outline if it fails
+	const outline_ir &load( FT_UInt glyph_index )
+	{
+		glyph_cache *cache = file.face_id() ? glyphs : NULL;
+		cache_key key;
+		if ( cache ) {
+			key = cache_key( file.face_id(), file.face_index, glyph_index );
+			hit = cache->find( key );
+			if ( hit ) {
+				metrics = hit->metrics;
+				return hit->ir;
 			}
-			tmp << "\n  <path fill='none' stroke='green'";
-			tmp << dash_mod;
-			tmp << " d='";
- 			tmp << " M " << ftpoints[i].x << "," << ftpoints[i].y;
- 			tmp << " L " << ftpoints[(i+1)%ftoutline.n_points].x << "," << ftpoints[(i+1)%ftoutline.n_points].y;
-			tmp << "\n  '/>";
 		}
-		return tmp.str();
+		face_lock guard = file.lock_face();
+		FT_Error e = FT_Load_Glyph( file.face, glyph_index, FT_LOAD_NO_SCALE );
+		if ( e ) {
+			error = e;
+			ir.clear();
+			memset( &metrics, 0, sizeof( metrics ) );
+			return ir;
+		}
+		ir.build( file.face->glyph->outline );
+		ir.units_per_em = file.face->units_per_EM;
+		metrics = file.face->glyph->metrics;
+		if ( cache ) cache->insert( key, ir, metrics );
+		return ir;
 	}
 
-	std::string labelpts() {
-		tmp.str("");
-		for ( int i = 0 ; i < ftoutline.n_points ; i++ ) {
-			tmp << "\n <g font-family='SVGFreeSansASCII,sans-serif' font-size='10'>\n";
-			tmp << "  <text id='revision'";
-			tmp << " x='" << ftpoints[i].x + 5 << "'";
-			tmp << " y='" << ftpoints[i].y - 5 << "'";
-			tmp << " stroke='none' fill='darkgreen'>\n";
-			tmp << "  " << ftpoints[i].x  << "," << ftpoints[i].y;
-			tmp << "  </text>\n";
-			tmp << " </g>\n";
+	void write( FT_UInt glyph_index, FT_ULong codepoint, bool has_codepoint )
+	{
+		const outline_ir &outline = load( glyph_index );
+		if ( format == sprite_svg_font ) {
+			buf.put( "<glyph glyph-name='" );
+			put_id( glyph_index, codepoint, has_codepoint );
+			if ( has_codepoint && xml_char( codepoint ) ) {
+				buf.put( "' unicode='&#x" );
+				put_hex( codepoint, 1 );
+				buf.put( ';' );
+			}
+			buf.put( "' horiz-adv-x='" );
+			put_units( metrics.horiAdvance );
+			put_path( outline );
+			buf.put( "/>\n" );
+		} else {
+			FT_Face face = file.face;
+			FT_Pos x0 = std::min<FT_Pos>( 0, metrics.horiBearingX );
+			FT_Pos x1 = std::max<FT_Pos>( metrics.horiAdvance, metrics.horiBearingX + metrics.width );
+			buf.put( "<symbol id='" );
+			put_id( glyph_index, codepoint, has_codepoint );
+			buf.put( "' viewBox='" );
+			put_units( x0 );
+			buf.put( ' ' );
+			put_units( -face->ascender );
+			buf.put( ' ' );
+			put_units( x1 - x0 );
+			buf.put( ' ' );
+			put_units( face->ascender - face->descender );
+			if ( outline.empty() ) {
+				buf.put( "'/>\n" );
+			} else {
+				buf.put( "'><path d='" );
+				do_path_data( outline, options, buf );
+				buf.put( "'/></symbol>\n" );
+			}
 		}
-		return tmp.str();
+		written++;
 	}
 
-	std::string outline()  {
-		std::vector<FT_Vector> pointsv(ftpoints,ftpoints+ftoutline.n_points);
-		std::vector<char> tagsv(tags,tags+ftoutline.n_points);
-		std::vector<short> contoursv(contours,contours+ftoutline.n_contours);
-		return do_outline(pointsv, tagsv, contoursv, this->offsetX, this->offsetY, this->generateBezierStatements);
+	// the end of the opening quote, then d='...' in font coordinates (y up)
+	void put_path( const outline_ir &outline )
+	{
+		buf.put( '\'' );
+		if ( outline.empty() ) return;
+		double scale = options.scale( file.face->units_per_EM );
+		buf.put( " d='" );
+		do_path_data( outline, options, affine( scale, scale ), buf );
+		buf.put( '\'' );
+	}
+
+	void put_id( FT_UInt glyph_index, FT_ULong codepoint, bool has_codepoint )
+	{
+		buf.put( id_prefix );
+		if ( has_codepoint ) {
+			buf.put( 'u' );
+			put_hex( codepoint, 4 );
+		} else {
+			buf.put( 'g' );
+			buf.put_int( glyph_index );
+		}
+	}
+
+	// font units, scaled to the output
+	void put_units( double v )
+	{
+		int decimals = options.decimals();
+		buf.put_fixed( toFixed( v * options.scale( file.face->units_per_EM ), fixedUnit( decimals ) ), decimals );
+	}
+
+	void put_hex( FT_ULong v, int digits )
+	{
+		char tmp[16];
+		int n = snprintf( tmp, sizeof( tmp ), "%0*lX", digits, (unsigned long)v );
+		buf.put( tmp, n );
+	}
+
+	void put_xml( const char * s )
+	{
+		for ( ; *s ; s++ ) {
+			switch ( *s ) {
+			case '&': buf.put( "&amp;" ); break;
+			case '<': buf.put( "&lt;" ); break;
+			case '>': buf.put( "&gt;" ); break;
+			case '\'': buf.put( "&apos;" ); break;
+			case '"': buf.put( "&quot;" ); break;
+			default: buf.put( *s );
+			}
+		}
+	}
+
+	// Characters a numeric reference may stand for in XML 1.0
+	static bool xml_char( FT_ULong c )
+	{
+		if ( c < 0x20 ) return c == 0x9 || c == 0xA || c == 0xD;
+		if ( c >= 0xD800 && c <= 0xDFFF ) return false;
+		return c != 0xFFFE && c != 0xFFFF && c <= 0x10FFFF;
+	}
+
+	void init( ttf_file &f, const outline_options &options )
+	{
+		file = f;
+		this->options = options;
+		this->options.offsetX = 0;
+		this->options.offsetY = 0;
+	}
+};
+
+/* Write many small files, such as one SVG per glyph, into one directory.
+
+Files are staged back to back in one reusable buffer: begin() names a
+file and returns the buffer to write its content into, and once more
+than 'capacity' bytes are staged (or on flush()) every staged file is
+written with one openat() on the open directory, one write() and one
+close(), with no per-file stream or string. 'error' keeps the errno of
+the first failure; 'files' counts the files written.
+*/
+class bulk_file_writer
+{
+public:
+	std::string dir;
+	size_t capacity;
+	int error;
+	size_t files;
+
+	bulk_file_writer( const std::string &dir, size_t capacity = 1 << 20 )
+		: dir( dir ), capacity( capacity ), error( 0 ), files( 0 )
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		dirfd = ::open( dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		if ( dirfd < 0 ) error = errno;
+#endif
+	}
+
+	~bulk_file_writer() { close(); }
+
+	bool ok() const { return error == 0; }
+
+	/* Start file 'name' (relative to dir); its content is what is put
+	into the returned buffer until the next begin(), flush() or close() */
+	out_buffer &begin( const std::string &name )
+	{
+		if ( data.size() >= capacity ) flush();
+		staged s;
+		s.name = names.size();
+		s.begin = data.size();
+		names.append( name.c_str(), name.size() + 1 );
+		pending.push_back( s );
+		return data;
+	}
+
+	void add( const std::string &name, const char * s, size_t n )
+	{
+		begin( name ).put( s, n );
+	}
+
+	/* Write every staged file */
+	void flush()
+	{
+		for ( size_t i = 0 ; i < pending.size() ; i++ ) {
+			size_t end = i + 1 < pending.size() ? pending[i+1].begin : data.size();
+			if ( !error ) write( names.c_str() + pending[i].name, data.data() + pending[i].begin, end - pending[i].begin );
+		}
+		pending.clear();
+		names.clear();
+		data.clear();
+	}
+
+	void close()
+	{
+		flush();
+#if defined(__unix__) || defined(__APPLE__)
+		if ( dirfd >= 0 ) ::close( dirfd );
+		dirfd = -1;
+#endif
+	}
+
+private:
+	bulk_file_writer( const bulk_file_writer & );
+	bulk_file_writer & operator=( const bulk_file_writer & );
+
+	struct staged
+	{
+		size_t name;   // offset in 'names'
+		size_t begin;  // offset in 'data'
+	};
+
+	out_buffer data;
+	std::string names;  // NUL terminated, back to back
+	std::vector<staged> pending;
+#if defined(__unix__) || defined(__APPLE__)
+	int dirfd;
+#endif
+
+	void write( const char * name, const char * s, size_t n )
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		int fd = openat( dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+		if ( fd < 0 ) {
+			error = errno;
+			return;
+		}
+		fd_sink out( fd );
+		out.write( s, n );
+		if ( out.error ) error = out.error;
+		if ( ::close( fd ) < 0 && !error ) error = errno;
+#else
+		std::ofstream out( ( dir + "/" + name ).c_str(), std::ios::binary );
+		out.write( s, n );
+		if ( !out ) error = EIO;
+#endif
+		if ( !error ) files++;
+	}
+};
+
+/* CRC-32 as zip uses it (polynomial 0xEDB88320), continued from 'crc' */
+inline uint32_t zip_crc32( uint32_t crc, const void * p, size_t n )
+{
+#ifdef FONT2SVG_ZLIB
+	const Bytef * b = static_cast<const Bytef *>( p );
+	while ( n > 0 ) {
+		uInt k = n > 0x40000000 ? 0x40000000 : (uInt)n;
+		crc = ::crc32( crc, b, k );
+		b += k;
+		n -= k;
+	}
+	return crc;
+#else
+	// filled once, thread-safely, by the first call
+	struct crc_table
+	{
+		uint32_t t[256];
+		crc_table()
+		{
+			for ( uint32_t i = 0 ; i < 256 ; i++ ) {
+				uint32_t c = i;
+				for ( int k = 0 ; k < 8 ; k++ ) c = c & 1 ? 0xEDB88320U ^ ( c >> 1 ) : c >> 1;
+				t[i] = c;
+			}
+		}
+	};
+	static const crc_table table;
+	const unsigned char * b = static_cast<const unsigned char *>( p );
+	crc = ~crc;
+	for ( size_t i = 0 ; i < n ; i++ ) crc = table.t[( crc ^ b[i] ) & 0xFF] ^ ( crc >> 8 );
+	return ~crc;
+#endif
+}
+
+enum archive_format {
+	archive_tar,  // POSIX ustar
+	archive_zip   // stored, or deflated when built with zlib
+};
+
+/* Write many small files, such as one SVG per glyph, as the members of a
+single tar or zip archive streamed to an output_sink: one sequential
+write instead of a file per glyph.
+
+Members are staged back to back in one reusable buffer, as with
+bulk_file_writer: begin() names a member and returns the buffer for its
+content. Once 'capacity' bytes are staged (or on flush()) the staged
+members get their checksums and, for a zip with 'deflate' set, are
+compressed on 'threads' workers (0: one per core), then written in
+order. Members that would not shrink are stored.
+
+'entries' is the name index: every member with the archive offset of its
+header, its size and how it is stored. A zip's central directory is
+written from it by close(); a tar gets it as a last member named
+'index_name' (one "offset size name" line per member, offsets of the
+member data) unless that is empty. 'error' keeps the first failure
+(ENAMETOOLONG for a tar name that does not fit, EFBIG past the limits of
+ustar or of a zip without zip64, ENOTSUP for deflate without zlib).
+*/
+class archive_writer
+{
+public:
+	struct entry
+	{
+		std::string name;
+		uint64_t offset;       // of the member's header
+		uint64_t data;         // of its (packed) data
+		size_t size, packed;   // bytes, and bytes as stored
+		uint32_t crc;
+		bool deflated;
+	};
+
+	archive_format format;
+	bool deflate;
+	int level;                 // zlib level for 'deflate'
+	unsigned int threads;
+	std::string index_name;    // tar only
+	time_t mtime;
+	int error;
+	std::vector<entry> entries;
+
+	archive_writer( output_sink &sink, archive_format format = archive_tar, size_t capacity = 1 << 20 )
+		: format( format ), deflate( false ), level( 6 ), threads( 0 ), index_name( "index" ),
+		  mtime( time( NULL ) ), error( 0 ), capacity( capacity ), out( sink ), closed( false ) {}
+
+	~archive_writer() { close(); }
+
+	bool ok() const { return error == 0; }
+
+	/* Start member 'name'; its content is what is put into the returned
+	buffer until the next begin(), flush() or close() */
+	out_buffer &begin( const std::string &name )
+	{
+		if ( data.size() >= capacity ) flush();
+		staged s;
+		s.name = name;
+		s.begin = data.size();
+		s.end = s.begin;
+		s.crc = 0;
+		s.deflated = false;
+		pending.push_back( s );
+		return data;
+	}
+
+	void add( const std::string &name, const char * s, size_t n )
+	{
+		begin( name ).put( s, n );
+	}
+
+	/* Write every staged member */
+	void flush()
+	{
+		if ( pending.empty() ) return;
+		for ( size_t i = 0 ; i < pending.size() ; i++ )
+			pending[i].end = i + 1 < pending.size() ? pending[i+1].begin : data.size();
+		pack();
+		for ( size_t i = 0 ; i < pending.size() && !error ; i++ ) write( pending[i] );
+		pending.clear();
+		data.clear();
+	}
+
+	/* Flush, then write the index and the end of the archive */
+	void close()
+	{
+		if ( closed ) return;
+		flush();
+		closed = true;
+		if ( format == archive_zip ) {
+			central_directory();
+		} else {
+			if ( !index_name.empty() && !error ) {
+				out_buffer index;
+				for ( size_t i = 0 ; i < entries.size() ; i++ ) {
+					index.put_int( (long)entries[i].data );
+					index.put( ' ' );
+					index.put_int( (long)entries[i].size );
+					index.put( ' ' );
+					index.put( entries[i].name );
+					index.put( '\n' );
+				}
+				staged s;
+				s.name = index_name;
+				s.begin = 0;
+				s.end = index.size();
+				s.crc = 0;
+				s.deflated = false;
+				size_t listed = entries.size();
+				write( s, index.data() );
+				// the index does not list itself; nothing to drop if it failed
+				if ( entries.size() > listed ) entries.pop_back();
+			}
+			char zeros[1024];
+			memset( zeros, 0, sizeof( zeros ) );
+			out.put( zeros, sizeof( zeros ) );
+		}
+		out.flush();
+	}
+
+private:
+	archive_writer( const archive_writer & );
+	archive_writer & operator=( const archive_writer & );
+
+	struct staged
+	{
+		std::string name;
+		size_t begin, end;     // content in 'data'
+		uint32_t crc;
+		bool deflated;         // 'packed' holds the deflated content
+		std::vector<unsigned char> packed;
+	};
+
+	size_t capacity;
+	out_buffer out;
+	out_buffer data;
+	std::deque<staged> pending; // deque: growing it never copies 'packed'
+	bool closed;
+
+	// Checksums, and deflate where asked for, spread over the workers
+	void pack()
+	{
+		if ( format == archive_zip && deflate ) {
+#ifdef FONT2SVG_ZLIB
+			unsigned int n = threads;
+			if ( n == 0 ) n = std::thread::hardware_concurrency();
+			if ( n == 0 ) n = 1;
+			if ( n > pending.size() ) n = pending.size();
+			std::vector<std::thread> pool;
+			for ( unsigned int w = 1 ; w < n ; w++ )
+				pool.push_back( std::thread( &archive_writer::compress, this, w, n ) );
+			compress( 0, n );
+			for ( size_t w = 0 ; w < pool.size() ; w++ ) pool[w].join();
+			return;
+#else
+			if ( !error ) error = ENOTSUP;
+#endif
+		}
+		for ( size_t i = 0 ; i < pending.size() ; i++ ) {
+			staged &s = pending[i];
+			s.deflated = false;
+			s.crc = format == archive_zip ? zip_crc32( 0, data.data() + s.begin, s.end - s.begin ) : 0;
+		}
+	}
+
+#ifdef FONT2SVG_ZLIB
+	// Worker w of n: members w, w+n, w+2n ... with one z_stream for all
+	void compress( unsigned int w, unsigned int n )
+	{
+		z_stream z;
+		memset( &z, 0, sizeof( z ) );
+		bool ready = deflateInit2( &z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+		for ( size_t i = w ; i < pending.size() ; i += n ) {
+			staged &s = pending[i];
+			const char * text = data.data() + s.begin;
+			size_t size = s.end - s.begin;
+			s.crc = zip_crc32( 0, text, size );
+			s.deflated = false;
+			if ( !ready || size == 0 || size > 0x7FFFFFFF ) continue;
+			deflateReset( &z );
+			s.packed.resize( deflateBound( &z, size ) );
+			z.next_in = (Bytef *)text;
+			z.avail_in = size;
+			z.next_out = &s.packed[0];
+			z.avail_out = s.packed.size();
+			if ( ::deflate( &z, Z_FINISH ) == Z_STREAM_END && z.total_out < size ) {
+				s.packed.resize( z.total_out );
+				s.deflated = true;
+			}
+		}
+		if ( ready ) deflateEnd( &z );
+	}
+#endif
+
+	void write( staged &s, const char * text = NULL )
+	{
+		if ( !text ) text = data.data() + s.begin;
+		entry e;
+		e.name = s.name;
+		e.offset = out.position();
+		e.size = s.end - s.begin;
+		e.crc = s.crc;
+		e.deflated = s.deflated;
+		e.packed = s.deflated ? s.packed.size() : e.size;
+		if ( format == archive_zip ) {
+			if ( entries.size() >= 0xFFFF || e.offset + 30 + e.name.size() + e.packed > 0xFFFFFFFFULL || e.name.size() > 0xFFFF ) {
+				error = EFBIG;
+				return;
+			}
+			out.put_le( 0x04034b50, 4 );
+			zip_common( e );
+			out.put_le( 0, 2 );            // extra field length
+			out.put( e.name );
+		} else if ( !tar_header( e ) ) {
+			return;
+		}
+		e.data = out.position();
+		if ( s.deflated ) out.put( (const char *)&s.packed[0], s.packed.size() );
+		else out.put( text, e.size );
+		if ( format == archive_tar ) {
+			char zeros[512];
+			memset( zeros, 0, sizeof( zeros ) );
+			out.put( zeros, ( 512 - e.size % 512 ) % 512 );
+		}
+		entries.push_back( e );
+	}
+
+	// The fields local headers and central directory entries share
+	void zip_common( const entry &e )
+	{
+		struct tm t;
+#if defined(__unix__) || defined(__APPLE__)
+		localtime_r( &mtime, &t );
+#else
+		t = *localtime( &mtime );
+#endif
+		unsigned dos_time = t.tm_hour << 11 | t.tm_min << 5 | t.tm_sec / 2;
+		unsigned dos_date = t.tm_year < 80 ? 0x21 : ( t.tm_year - 80 ) << 9 | ( t.tm_mon + 1 ) << 5 | t.tm_mday;
+		out.put_le( 20, 2 );               // version needed: 2.0
+		out.put_le( 0x0800, 2 );           // names are UTF-8
+		out.put_le( e.deflated ? 8 : 0, 2 );
+		out.put_le( dos_time, 2 );
+		out.put_le( dos_date, 2 );
+		out.put_le( e.crc, 4 );
+		out.put_le( e.packed, 4 );
+		out.put_le( e.size, 4 );
+		out.put_le( e.name.size(), 2 );
+	}
+
+	void central_directory()
+	{
+		if ( error ) return;
+		uint64_t start = out.position();
+		for ( size_t i = 0 ; i < entries.size() ; i++ ) {
+			const entry &e = entries[i];
+			out.put_le( 0x02014b50, 4 );
+			out.put_le( 20, 2 );           // version made by
+			zip_common( e );
+			out.put_le( 0, 2 );            // extra field length
+			out.put_le( 0, 2 );            // comment length
+			out.put_le( 0, 2 );            // disk number
+			out.put_le( 0, 2 );            // internal attributes
+			out.put_le( 0, 4 );            // external attributes
+			out.put_le( e.offset, 4 );
+			out.put( e.name );
+		}
+		uint64_t size = out.position() - start;
+		if ( start + size > 0xFFFFFFFFULL ) {
+			error = EFBIG;
+			return;
+		}
+		out.put_le( 0x06054b50, 4 );
+		out.put_le( 0, 2 );
+		out.put_le( 0, 2 );
+		out.put_le( entries.size(), 2 );
+		out.put_le( entries.size(), 2 );
+		out.put_le( size, 4 );
+		out.put_le( start, 4 );
+		out.put_le( 0, 2 );                // comment length
 	}
 
-	std::string svgfooter()  {
-		tmp.str("");
-		tmp << "\n </g>\n</svg>\n";
-		return tmp.str();
+	bool tar_header( const entry &e )
+	{
+		char h[512];
+		memset( h, 0, sizeof( h ) );
+		// names over 100 bytes are split at a '/' into prefix and name
+		size_t n = e.name.size(), cut = 0;
+		if ( n > 100 ) {
+			cut = e.name.rfind( '/', 155 );
+			if ( cut == std::string::npos || n - cut - 1 > 100 || cut == 0 ) {
+				error = ENAMETOOLONG;
+				return false;
+			}
+			memcpy( h + 345, e.name.data(), cut );
+			cut++;
+		}
+		memcpy( h, e.name.data() + cut, n - cut );
+		snprintf( h + 100, 8, "%07o", 0644 );
+		snprintf( h + 108, 8, "%07o", 0 );
+		snprintf( h + 116, 8, "%07o", 0 );
+		const unsigned long long octal11 = 077777777777ULL; // 8 GB, the ustar limit
+		if ( e.size > octal11 ) {
+			error = EFBIG;
+			return false;
+		}
+		snprintf( h + 124, 12, "%011llo", (unsigned long long)e.size );
+		snprintf( h + 136, 12, "%011llo", std::min( (unsigned long long)( mtime > 0 ? mtime : 0 ), octal11 ) );
+		h[156] = '0';
+		memcpy( h + 257, "ustar", 6 );
+		memcpy( h + 263, "00", 2 );
+		memset( h + 148, ' ', 8 );
+		unsigned sum = 0;
+		for ( int i = 0 ; i < 512 ; i++ ) sum += (unsigned char)h[i];
+		snprintf( h + 148, 8, "%06o", sum );
+		out.put( h, sizeof( h ) );
+		return true;
 	}
 };
 